@@ -50,6 +50,77 @@ G_BEGIN_DECLS
 
 typedef struct nci_adapter_priv NciAdapterPriv;
 
+/*
+ * Handles C-APDU received in ISO-DEP card emulation mode. Returns TRUE
+ * if the APDU has been (or will be) answered with nci_adapter_respond_apdu,
+ * FALSE if it's not handled (the adapter responds with 6F00 in that case).
+ * If nci_adapter_respond_apdu fails from within the handler, 6F00 is sent
+ * regardless of what the handler returns.
+ * It's invoked straight from the data packet handler, to meet the frame
+ * waiting time it's best to respond right away.
+ */
+typedef
+gboolean
+(*NciAdapterApduFunc)(
+    NciAdapter* adapter,
+    NfcInitiator* initiator,
+    const void* apdu,
+    guint len,
+    void* user_data);
+
+/* Dynamic logical connections */
+
+typedef
+void
+(*NciAdapterConnFunc)(
+    NciAdapter* adapter,
+    guint conn_id,
+    gboolean open,
+    void* user_data);
+
+typedef
+void
+(*NciAdapterConnDataFunc)(
+    NciAdapter* adapter,
+    guint conn_id,
+    const void* data,
+    guint len,
+    void* user_data);
+
+typedef
+void
+(*NciAdapterConnSendFunc)(
+    NciAdapter* adapter,
+    guint conn_id,
+    gboolean ok,
+    void* user_data);
+
+/* Completion of nci_adapter_t2_write */
+typedef
+void
+(*NciAdapterT2WriteFunc)(
+    NciAdapter* adapter,
+    gboolean ok,
+    guint written, /* Number of pages actually written */
+    void* user_data);
+
+typedef enum nci_adapter_aid_match {
+    NCI_ADAPTER_AID_MATCH_EXACT,
+    NCI_ADAPTER_AID_MATCH_PREFIX /* Any AID starting with these bytes */
+} NCI_ADAPTER_AID_MATCH;
+
+/* Listen mode routing */
+#define NCI_ADAPTER_NFCEE_DH (0x00)
+#define NCI_ADAPTER_POWER_SWITCHED_ON (0x01)
+#define NCI_ADAPTER_POWER_SWITCHED_OFF (0x02)
+#define NCI_ADAPTER_POWER_BATTERY_OFF (0x04)
+
+typedef enum nci_adapter_uid_filter {
+    NCI_ADAPTER_UID_FILTER_NONE,
+    NCI_ADAPTER_UID_FILTER_ALLOW, /* Only the listed UIDs are accepted */
+    NCI_ADAPTER_UID_FILTER_DENY /* The listed UIDs are ignored */
+} NCI_ADAPTER_UID_FILTER;
+
 struct nci_adapter {
     NfcAdapter parent;
     NfcTarget* target;
@@ -64,15 +135,85 @@ typedef struct nci_adapter_class {
     void (*current_state_changed)(NciAdapter* adapter);
     void (*next_state_changed)(NciAdapter* adapter);
 
+    /*
+     * Returns the delay (in milliseconds) before the next presence check.
+     * The count is the number of consecutive successful presence checks
+     * since the target has been activated or since the last transmission
+     * error. Zero means the default (shortest) period.
+     */
+    guint (*presence_check_period)(NciAdapter* adapter, NCI_PROTOCOL protocol,
+        guint count);
+
+    /*
+     * Sends NCI 2.0 RF_ISO_DEP_NAK_PRESENCE_CMD if NFCC supports it and
+     * returns TRUE, in which case the derived class must report the outcome
+     * (RF_ISO_DEP_NAK_PRESENCE_NTF) with nci_adapter_iso_dep_nak_presence().
+     * Base implementation returns FALSE, meaning that an empty I-block is
+     * used for ISO-DEP presence checks.
+     */
+    gboolean (*iso_dep_nak_presence_check)(NciAdapter* adapter);
+
+    /*
+     * Returns the time (in milliseconds) for which the target that has
+     * failed presence check is kept around, in case if it reappears.
+     * If the same target gets activated within this period, the existing
+     * NfcTarget (and everything attached to it) is reused. Only applies
+     * to targets with a stable NFCID, i.e. not to ISO-DEP cards and
+     * random UIDs, those are always dropped right away. Base
+     * implementation returns zero, meaning that the target is dropped
+     * right away.
+     */
+    guint (*target_grace_period)(NciAdapter* adapter, NCI_PROTOCOL protocol);
+
+    /*
+     * Reactivates the target by putting it to sleep (RF_DEACTIVATE_CMD
+     * with Sleep Mode) and selecting it again (RF_DISCOVER_SELECT_CMD),
+     * which is faster than going through the whole discovery. Returns
+     * TRUE if the commands have been submitted, in which case the usual
+     * RF_INTF_ACTIVATED_NTF is expected. If something goes wrong later,
+     * the derived class should switch NciCore to RFST_DISCOVERY. Base
+     * implementation returns FALSE, meaning full rediscovery.
+     */
+    gboolean (*reactivate_sleep_select)(NciAdapter* adapter,
+        guint8 discovery_id, NCI_PROTOCOL protocol, NCI_RF_INTERFACE rf_intf);
+
+    /*
+     * Returns FWI (0..14) advertised in listen mode, i.e. the value of
+     * LI_A_RATS_TB1 (or LI_FWI in NCI 1.0) for listen A and the one
+     * sent in ATQB for listen B, as read back from NFCC configuration.
+     * It's used to compute the deadline for R-APDU in card emulation
+     * mode. Anything above 14 means that FWI is unknown and the deadline
+     * isn't tracked, which is what base implementation returns.
+     */
+    guint (*listen_fwi)(NciAdapter* adapter, NCI_MODE mode);
+
+    /*
+     * Sends RF_SET_LISTEN_MODE_ROUTING_CMD for each of the payloads, in
+     * the order given, each one after the previous RSP, and returns TRUE.
+     * It's only invoked in RFST_IDLE state. NciCore is kept in RFST_IDLE
+     * until the derived class reports the outcome (after the last RSP
+     * or the first failure) with nci_adapter_listen_mode_routing_done().
+     * NULL by default, in which case routes are never programmed and
+     * discovery is never interrupted for that, and NFCC keeps routing
+     * everything to the host.
+     */
+    gboolean (*set_listen_mode_routing)(NciAdapter* adapter,
+        const GUtilData* payloads, guint count);
+
+    /*
+     * Sends CORE_CONN_CREATE_CMD and returns TRUE, in which case the
+     * derived class must report the outcome with nci_adapter_conn_created()
+     * and connection loss with nci_adapter_conn_closed(). Flow control
+     * (CORE_CONN_CREDITS_NTF) is left to NciCore. Base implementation
+     * returns FALSE, meaning that dynamic connections are not supported.
+     */
+    gboolean (*conn_create)(NciAdapter* adapter, guint conn_id,
+        guint8 dest_type, const GUtilData* dest_params);
+
+    /* Sends CORE_CONN_CLOSE_CMD, the outcome is of no interest */
+    void (*conn_close)(NciAdapter* adapter, guint8 cid);
+
     /* Padding for future expansion */
-    void (*_reserved1)(void);
-    void (*_reserved2)(void);
-    void (*_reserved3)(void);
-    void (*_reserved4)(void);
-    void (*_reserved5)(void);
-    void (*_reserved6)(void);
-    void (*_reserved7)(void);
-    void (*_reserved8)(void);
     void (*_reserved9)(void);
     void (*_reserved10)(void);
 } NciAdapterClass;
@@ -98,6 +239,226 @@ void
 nci_adapter_finalize_core(
     NciAdapter* adapter);
 
+/*
+ * Completes ISO-DEP NAK presence check started by iso_dep_nak_presence_check
+ * callback. The present flag is TRUE if RF_ISO_DEP_NAK_PRESENCE_NTF reported
+ * success, FALSE if the check has failed.
+ */
+void
+nci_adapter_iso_dep_nak_presence(
+    NciAdapter* adapter,
+    gboolean present);
+
+/*
+ * Enables ISO-DEP card emulation. Without the handler, ISO-DEP activations
+ * in listen mode are ignored. NULL removes the handler. Card emulation
+ * mode is reported as supported while there's a handler (this one or an
+ * AID handler) or a Type 3 tag service.
+ */
+void
+nci_adapter_set_apdu_handler(
+    NciAdapter* adapter,
+    NciAdapterApduFunc handler,
+    void* user_data);
+
+/* Sends R-APDU in response to the C-APDU passed to NciAdapterApduFunc */
+gboolean
+nci_adapter_respond_apdu(
+    NciAdapter* adapter,
+    NfcInitiator* initiator,
+    const void* apdu,
+    guint len);
+
+/* Same as above but sends the bytes by reference, without copying */
+gboolean
+nci_adapter_respond_apdu_bytes(
+    NciAdapter* adapter,
+    NfcInitiator* initiator,
+    GBytes* apdu);
+
+/*
+ * Routes SELECT by DF name to the handler registered for the selected AID.
+ * Subsequent APDUs go to the same handler until the next SELECT. Higher
+ * priority wins, for the same priority the longer AID is preferred.
+ * APDUs arriving before any AID has been selected go to the handler set
+ * by nci_adapter_set_apdu_handler (if any). Returns the id that can be
+ * passed to nci_adapter_remove_aid_handler, zero on failure.
+ */
+guint
+nci_adapter_add_aid_handler(
+    NciAdapter* adapter,
+    const GUtilData* aid,
+    NCI_ADAPTER_AID_MATCH match,
+    int priority,
+    NciAdapterApduFunc handler,
+    void* user_data);
+
+void
+nci_adapter_remove_aid_handler(
+    NciAdapter* adapter,
+    guint id);
+
+/*
+ * Emulates read-only Type 4 tag. The file contains the NDEF file image
+ * (2 bytes of NLEN followed by the NDEF message) and is mapped into
+ * memory. NULL path stops the emulation.
+ */
+gboolean
+nci_adapter_set_t4_ndef_file(
+    NciAdapter* adapter,
+    const char* path);
+
+/*
+ * Emulates Type 3 tag in listen F mode. Each service has a fixed number
+ * of 16-byte blocks, initially copied from data (or zeroed if data is
+ * NULL). Check and Update commands are handled by the plugin. Adding the
+ * same service again replaces its blocks. Services which require
+ * authentication (bit 0 of the code is zero) are rejected.
+ */
+gboolean
+nci_adapter_add_t3t_service(
+    NciAdapter* adapter,
+    guint16 service_code,
+    guint nblocks,
+    const void* data);
+
+/* Current contents of the block, possibly updated by the reader */
+const guint8*
+nci_adapter_t3t_block(
+    NciAdapter* adapter,
+    guint16 service_code,
+    guint block);
+
+/*
+ * Listen mode routing table. Traffic matching the route goes to the
+ * specified NFCEE (NCI_ADAPTER_NFCEE_DH is the host) in the specified
+ * power states, without waking the host if it's not the destination.
+ * AID routes take precedence over protocol routes, and those over
+ * technology routes. Changes are programmed into NFCC the next time
+ * it's idle (briefly interrupting discovery if necessary). Functions
+ * adding routes return the id that can be passed to
+ * nci_adapter_remove_listen_route, zero on failure.
+ */
+guint
+nci_adapter_add_technology_route(
+    NciAdapter* adapter,
+    NFC_TECHNOLOGY technology,
+    guint8 nfcee,
+    guint8 power);
+
+guint
+nci_adapter_add_protocol_route(
+    NciAdapter* adapter,
+    NCI_PROTOCOL protocol,
+    guint8 nfcee,
+    guint8 power);
+
+guint
+nci_adapter_add_aid_route(
+    NciAdapter* adapter,
+    const GUtilData* aid,
+    guint8 nfcee,
+    guint8 power);
+
+void
+nci_adapter_remove_listen_route(
+    NciAdapter* adapter,
+    guint id);
+
+/* Completes set_listen_mode_routing, NciCore may then leave RFST_IDLE */
+void
+nci_adapter_listen_mode_routing_done(
+    NciAdapter* adapter,
+    gboolean ok);
+
+/*
+ * Opens dynamic logical connection (e.g. to NFCEE). The state callback
+ * is invoked with open=TRUE once the connection has been created, or
+ * with open=FALSE if it couldn't be created or has been closed by NFCC.
+ * In the latter case the id becomes invalid. Returns zero if the
+ * connection can't be created at all.
+ */
+guint
+nci_adapter_conn_create(
+    NciAdapter* adapter,
+    guint8 dest_type,
+    const GUtilData* dest_params,
+    NciAdapterConnFunc state,
+    NciAdapterConnDataFunc data,
+    void* user_data);
+
+/*
+ * Queues the data message. Each connection has its own queue, messages
+ * are passed to NciCore one at a time.
+ */
+gboolean
+nci_adapter_conn_send(
+    NciAdapter* adapter,
+    guint conn_id,
+    GBytes* data,
+    NciAdapterConnSendFunc done,
+    void* user_data);
+
+/* Closes the connection, pending data is dropped, no callbacks */
+void
+nci_adapter_conn_close(
+    NciAdapter* adapter,
+    guint conn_id);
+
+/* These are invoked by the derived class, see conn_create callback */
+void
+nci_adapter_conn_created(
+    NciAdapter* adapter,
+    guint conn_id,
+    gboolean ok,
+    guint8 cid,
+    guint max_payload);
+
+void
+nci_adapter_conn_closed(
+    NciAdapter* adapter,
+    guint8 cid);
+
+/*
+ * Loads the set of UIDs (one per line, in hex) from the file. Activated
+ * targets which don't pass the filter are rejected before anything gets
+ * allocated for them. With the allow list, targets without UID are
+ * rejected too. Rejected targets are subject to the same discovery
+ * backoff as unsupported ones. NCI_ADAPTER_UID_FILTER_NONE removes the
+ * filter, the path is ignored in that case and required otherwise.
+ */
+gboolean
+nci_adapter_set_uid_filter(
+    NciAdapter* adapter,
+    NCI_ADAPTER_UID_FILTER type,
+    const char* path);
+
+/*
+ * Writes the memory image (a whole number of 4-byte pages) to the
+ * current Type 2 tag, starting at the given page. Pages matching the
+ * page cache or the previous image (optional, must be the same size)
+ * are skipped, the rest are written with back-to-back WRITE commands,
+ * a sector at a time. The completion callback is invoked once, unless
+ * the write is cancelled. If the target goes away before the write has
+ * completed, the callback reports failure and zero pages written.
+ * Only one write can be pending at a time. Returns the id that can be
+ * passed to nci_adapter_t2_cancel_write, zero on failure.
+ */
+guint
+nci_adapter_t2_write(
+    NciAdapter* adapter,
+    guint page,
+    const GUtilData* data,
+    const GUtilData* prev,
+    NciAdapterT2WriteFunc done,
+    void* user_data);
+
+/* Cancels the write, the completion callback is not invoked */
+void
+nci_adapter_t2_cancel_write(
+    NciAdapter* adapter,
+    guint id);
+
 G_END_DECLS
 
 #endif /* NCI_PLUGIN_H */
@@ -50,28 +50,120 @@
 #include <nfc_peer.h>
 
 #include <nci_core.h>
-#include <nci_util.h>
 
 #include <gutil_misc.h>
 #include <gutil_macros.h>
 
 GLOG_MODULE_DEFINE("nciplugin");
 
+/* Recently seen activations which we can't handle */
+#define UNSUPPORTED_CACHE_SIZE (4)
+#define UNSUPPORTED_BACKOFF_MIN_MS (100)
+#define UNSUPPORTED_BACKOFF_MAX_MS (5000)
+#define UNSUPPORTED_FORGET_MS (10000) /* Since it was last seen */
+
+typedef struct nci_adapter_unsupported {
+    NciFingerprint fp; /* Hash table key */
+    guint count;
+    gint64 last_seen;
+} NciAdapterUnsupported;
+
+/* Listen mode routing (in the order of precedence) */
+typedef enum nci_adapter_route_type {
+    ROUTE_AID,
+    ROUTE_PROTOCOL,
+    ROUTE_TECHNOLOGY,
+    ROUTE_TYPE_COUNT
+} ROUTE_TYPE;
+
+/* NCI Routing Entry types */
+static const guint8 route_entry_type[] = { 0x02, 0x01, 0x00 };
+
+#define ROUTE_MAX_AID_LEN (16)
+#define ROUTING_CMD_MAX_PAYLOAD (255)
+#define ROUTING_TIMEOUT_MS (2000)
+
+typedef struct nci_adapter_listen_route {
+    guint id;
+    ROUTE_TYPE type;
+    guint8 nfcee;
+    guint8 power;
+    guint8 len;
+    guint8 value[ROUTE_MAX_AID_LEN]; /* Technology, protocol or AID */
+} NciAdapterListenRoute;
+
+/* Response time statistics */
+typedef struct nci_adapter_apdu_stats {
+    guint count;
+    guint near_misses; /* Answered in the last quarter of FWT */
+    guint late; /* Took longer than FWT */
+} NciAdapterApduStats;
+
+typedef struct nci_adapter_aid_route {
+    guint id;
+    NciAdapterApduFunc handler;
+    void* user_data;
+    NciAdapterApduStats stats;
+} NciAdapterAidRoute;
+
+/* Reactivation statistics */
+enum {
+    REACTIVATE_PATH_DISCOVERY,
+    REACTIVATE_PATH_SLEEP_SELECT,
+    REACTIVATE_PATH_COUNT
+};
+
+static const char* reactivate_path_name[] = {
+    "discovery",
+    "sleep/select"
+};
+
 /* NCI core events */
 enum {
     CORE_EVENT_CURRENT_STATE,
     CORE_EVENT_NEXT_STATE,
     CORE_EVENT_INTF_ACTIVATED,
+    CORE_EVENT_DATA_PACKET,
     CORE_EVENT_COUNT
 };
 
+/* Parameter lengths are single bytes in RF_INTF_ACTIVATED_NTF */
+#define INTF_INFO_MAX_PARAM_LEN (0xff)
+#define INTF_INFO_POOL_SIZE (2)
+#define INTF_INFO_MAX_NFCID_LEN (10)
+#define RANDOM_UID_SIZE (4)
+#define RANDOM_UID_START_BYTE (0x08)
+
+/* Converted parameters which have been looked at */
+#define INTF_PARAM_POLL (0x01)
+#define INTF_PARAM_ISO_DEP_POLL_A (0x02)
+#define INTF_PARAM_ISO_DEP_POLL_B (0x04)
+
+typedef struct nci_adapter_t2_write {
+    guint id; /* Zero while nci_target_t2_write() is being called */
+    NciAdapterT2WriteFunc done;
+    void* user_data;
+} NciAdapterT2Write;
+
 typedef struct nci_adapter_intf_info {
+    guint8 discovery_id;
     NCI_RF_INTERFACE rf_intf;
     NCI_PROTOCOL protocol;
     NCI_MODE mode;
-    GUtilData mode_param;
-    GUtilData activation_param;
-    NciModeParam* mode_param_parsed;
+    NciFingerprint fingerprint;
+    guint8 nfcid_len; /* Zero if there's no stable NFCID */
+    guint8 nfcid[INTF_INFO_MAX_NFCID_LEN];
+    /* Converted on first use, NULL if not applicable */
+    guint params_converted; /* INTF_PARAM_* bits */
+    const NfcParamPoll* poll;
+    const NfcParamIsoDepPollA* iso_dep_poll_a;
+    const NfcParamIsoDepPollB* iso_dep_poll_b;
+    NfcParamPoll poll_buf;
+    NfcParamIsoDepPollA iso_dep_poll_a_buf;
+    NfcParamIsoDepPollB iso_dep_poll_b_buf;
+    guint param_data_used;
+    /* Fixed size, so that it can be recycled */
+    guint8 param_data[INTF_INFO_MAX_PARAM_LEN];
 } NciAdapterIntfInfo;
 
 struct nci_adapter_priv {
@@ -82,8 +174,47 @@ struct nci_adapter_priv {
     guint mode_check_id;
     guint presence_check_id;
     guint presence_check_timer;
+    guint presence_check_period;
+    guint presence_check_count;
+    gint64 presence_check_window; /* When the current period has started */
     NciAdapterIntfInfo* active_intf;
+    NciAdapterIntfInfo* intf_pool[INTF_INFO_POOL_SIZE];
+    guint intf_pool_count;
+    guint intf_count; /* Number of activations */
+    guint param_count; /* Number of parameter conversions */
     gboolean reactivating;
+    gboolean reactivating_fast; /* Using sleep/select */
+    gint64 reactivate_start;
+    guint reactivate_count[REACTIVATE_PATH_COUNT];
+    gint64 reactivate_time[REACTIVATE_PATH_COUNT]; /* Microseconds */
+    guint grace_timer; /* Target is lost but may reappear */
+    guint reactivate_timer; /* Target is being reactivated */
+    GHashTable* t2_no_version; /* Fingerprints of T2 without GET_VERSION */
+    NciAdapterT2Write* t2_write;
+    NciAdapterApduFunc apdu_handler;
+    void* apdu_handler_data;
+    NciAidTable* aid_table;
+    NciAdapterAidRoute* aid_route; /* Selected application */
+    NciAdapterApduStats apdu_stats; /* APDUs outside of AID routes */
+    NciT4Ndef* t4_ndef;
+    NciT3tStore* t3t_store;
+    GPtrArray* listen_routes;
+    guint last_listen_route_id;
+    gboolean listen_routes_dirty; /* Need to be programmed into NFCC */
+    gboolean listen_routes_idle; /* Went to RFST_IDLE to program them */
+    guint listen_routes_timer; /* Being programmed, staying in RFST_IDLE */
+    guint nfcee_activations;
+    GPtrArray* conns;
+    guint last_conn_id;
+    guint t4_ndef_route_id;
+    NciUidFilter* uid_filter;
+    NCI_ADAPTER_UID_FILTER uid_filter_type;
+    guint uid_filter_rejected;
+    GHashTable* unsupported; /* NciFingerprint => NciAdapterUnsupported */
+    guint discovery_hold_id; /* Not going back to discovery yet */
+    guint unsupported_count;
+    guint discovery_hold_count;
+    guint64 discovery_hold_ms;
     NfcInitiator *initiator;
 };
 
@@ -96,184 +227,173 @@ struct nci_adapter_priv {
 G_DEFINE_ABSTRACT_TYPE(NciAdapter, nci_adapter, NFC_TYPE_ADAPTER)
 
 #define PRESENCE_CHECK_PERIOD_MS (250)
-
-#define RANDOM_UID_SIZE (4)
-#define RANDOM_UID_START_BYTE (0x08)
+#define PRESENCE_CHECK_FAST_COUNT (4)
+#define PRESENCE_CHECK_MAX_PERIOD_MS (2000)
+#define PRESENCE_CHECK_MAX_PERIOD_ISO_DEP_MS (1000)
+#define REACTIVATE_TIMEOUT_MS (2000)
+#define T2_NO_VERSION_CACHE_SIZE (16)
+#define LISTEN_FWI_MAX (14)
+#define LISTEN_FWI_UNKNOWN (LISTEN_FWI_MAX + 1)
 
 /*==========================================================================*
  * Implementation
  *==========================================================================*/
 
+static
+gboolean
+nci_adapter_stable_nfcid(
+    GUtilData* nfcid,
+    const NciIntfActivationNtf* ntf)
+{
+    const NciModeParam* mp = ntf->mode_param;
+
+    /* ISO-DEP cards are free to pick a new UID after losing the field */
+    memset(nfcid, 0, sizeof(*nfcid));
+    if (mp && ntf->protocol != NCI_PROTOCOL_ISO_DEP) {
+        switch (ntf->mode) {
+        case NCI_MODE_PASSIVE_POLL_A:
+        case NCI_MODE_ACTIVE_POLL_A:
+            /* Random UIDs (AN10927) are single sized and start with 0x08 */
+            if (mp->poll_a.nfcid1_len &&
+                !(mp->poll_a.nfcid1_len == RANDOM_UID_SIZE &&
+                  mp->poll_a.nfcid1[0] == RANDOM_UID_START_BYTE)) {
+                nfcid->bytes = mp->poll_a.nfcid1;
+                nfcid->size = mp->poll_a.nfcid1_len;
+            }
+            break;
+        case NCI_MODE_PASSIVE_POLL_F:
+        case NCI_MODE_ACTIVE_POLL_F:
+            nfcid->bytes = mp->poll_f.nfcid2;
+            nfcid->size = sizeof(mp->poll_f.nfcid2);
+            break;
+        case NCI_MODE_PASSIVE_POLL_B:
+        case NCI_MODE_PASSIVE_POLL_15693:
+        case NCI_MODE_PASSIVE_LISTEN_A:
+        case NCI_MODE_PASSIVE_LISTEN_B:
+        case NCI_MODE_PASSIVE_LISTEN_F:
+        case NCI_MODE_ACTIVE_LISTEN_A:
+        case NCI_MODE_ACTIVE_LISTEN_F:
+        case NCI_MODE_PASSIVE_LISTEN_15693:
+            break;
+        }
+    }
+    return nfcid->size > 0 && nfcid->size <= INTF_INFO_MAX_NFCID_LEN;
+}
+
 static
 NciAdapterIntfInfo*
 nci_adapter_intf_info_new(
-    const NciIntfActivationNtf* ntf)
+    NciAdapterPriv* priv,
+    const NciIntfActivationNtf* ntf,
+    const NciFingerprint* fp)
 {
     if (ntf) {
-        /* Allocate the whole thing from a single memory block */
-        const gsize total = G_ALIGN8(sizeof(NciAdapterIntfInfo)) +
-            G_ALIGN8(ntf->mode_param_len) + ntf->activation_param_len;
-        NciAdapterIntfInfo* info = g_malloc(total);
-        guint8* ptr = (guint8*)info;
+        /* Recycle the previously used block, if there is one */
+        NciAdapterIntfInfo* info = priv->intf_pool_count ?
+            priv->intf_pool[--priv->intf_pool_count] :
+            g_slice_new(NciAdapterIntfInfo);
+        GUtilData nfcid;
 
+        info->discovery_id = ntf->discovery_id;
         info->rf_intf = ntf->rf_intf;
         info->protocol = ntf->protocol;
         info->mode = ntf->mode;
-        ptr += G_ALIGN8(sizeof(NciAdapterIntfInfo));
-
-        info->mode_param.size = ntf->mode_param_len;
-        if (ntf->mode_param_len) {
-            info->mode_param.bytes = ptr;
-            memcpy(ptr, ntf->mode_param_bytes, ntf->mode_param_len);
-            ptr += G_ALIGN8(ntf->mode_param_len);
-        } else {
-            info->mode_param.bytes = NULL;
+        info->nfcid_len = 0;
+        if (nci_adapter_stable_nfcid(&nfcid, ntf)) {
+            info->nfcid_len = (guint8)nfcid.size;
+            memcpy(info->nfcid, nfcid.bytes, nfcid.size);
         }
 
-        info->activation_param.size = ntf->activation_param_len;
-        if (ntf->activation_param_len) {
-            info->activation_param.bytes = ptr;
-            memcpy(ptr, ntf->activation_param_bytes, ntf->activation_param_len);
-        } else {
-            info->activation_param.bytes = NULL;
-        }
-
-        info->mode_param_parsed = nci_util_copy_mode_param(ntf->mode_param,
-            ntf->mode);
+        /* Converted parameters are filled in when someone needs them */
+        info->params_converted = 0;
+        info->poll = NULL;
+        info->iso_dep_poll_a = NULL;
+        info->iso_dep_poll_b = NULL;
+        info->param_data_used = 0;
 
+        memcpy(&info->fingerprint, fp, sizeof(*fp));
+        priv->intf_count++;
         return info;
     }
     return NULL;
 }
 
 static
-gboolean
-mode_param_match_poll_a(
-    const NciModeParamPollA* pa1,
-    const NciModeParamPollA* pa2)
+void
+nci_adapter_intf_info_free(
+    NciAdapterPriv* priv,
+    NciAdapterIntfInfo* info)
 {
-    /*
-    * Compare all fields except UID 'cause UID may be
-    * changed after losing field
-    */
-    return pa1->sel_res == pa2->sel_res &&
-        pa1->sel_res_len == pa2->sel_res_len &&
-        !memcmp(pa1->sens_res, pa2->sens_res, sizeof(pa2->sens_res));
+    if (priv->intf_pool_count < INTF_INFO_POOL_SIZE) {
+        priv->intf_pool[priv->intf_pool_count++] = info;
+    } else {
+        g_slice_free(NciAdapterIntfInfo, info);
+    }
 }
 
 static
 gboolean
-mode_param_match_poll_b(
-    const NciModeParamPollB* pb1,
-    const NciModeParamPollB* pb2)
+nci_adapter_intf_info_matches(
+    NciAdapterPriv* priv,
+    NciAdapterIntfInfo* info,
+    const NciFingerprint* fp)
 {
-    /*
-    * Compare all fields except UID 'cause UID may be
-    * changed after losing field
-    */
-    return pb1->fsc == pb2->fsc &&
-        !memcmp(pb1->app_data, pb2->app_data, sizeof(pb2->app_data)) &&
-        pb1->prot_info.size == pb2->prot_info.size &&
-        gutil_data_equal(&pb1->prot_info, &pb2->prot_info);
+    /* Interface, protocol and mode are a part of the fingerprint */
+    return info && nci_fingerprint_equal(&info->fingerprint, fp);
 }
 
 static
 gboolean
-mode_param_match_poll_a_t2(
-    const NciModeParamPollA* pa1,
-    const NciModeParamPollA* pa2)
+nci_adapter_intf_info_same_nfcid(
+    NciAdapterIntfInfo* info,
+    const NciIntfActivationNtf* ntf)
 {
-    gboolean partial_match = mode_param_match_poll_a(pa1, pa2);
+    GUtilData nfcid;
 
-    /*
-    * For tag type 2 logic is almost the same, but random UID has some
-    * limitations: according to AN10927 Random UID RID should be handled
-    * separately - single sized (4 bytes) starting with 0x08
-    */
-    if (pa1->nfcid1_len == pa2->nfcid1_len &&
-        pa2->nfcid1_len == RANDOM_UID_SIZE &&
-        pa1->nfcid1[0] == pa2->nfcid1[0] &&
-        pa2->nfcid1[0] == RANDOM_UID_START_BYTE) {
-        return partial_match;
-    } else {
-        /* Otherwise UID should fully match */
-        return partial_match &&
-            pa1->nfcid1_len == pa2->nfcid1_len &&
-            !memcmp(pa1->nfcid1, pa2->nfcid1, pa2->nfcid1_len);
-    }
+    return info->nfcid_len && nci_adapter_stable_nfcid(&nfcid, ntf) &&
+        nfcid.size == info->nfcid_len &&
+        !memcmp(nfcid.bytes, info->nfcid, nfcid.size);
 }
 
 static
-gboolean
-nci_adapter_info_mode_params_matches(
-    const NciAdapterIntfInfo* info,
-    const NciIntfActivationNtf* ntf)
+void
+nci_adapter_t2_write_abort(
+    NciAdapter* self,
+    NfcTarget* target)
 {
-    const NciModeParam* mp1 = info->mode_param_parsed;
-    const NciModeParam* mp2 = ntf->mode_param;
+    NciAdapterPriv* priv = self->priv;
+    NciAdapterT2Write* write = priv->t2_write;
 
-    if (mp1 && mp2) {
-        /* Mode params criteria depends on type of tag */
-        switch (ntf->mode) {
-        case NCI_MODE_PASSIVE_POLL_A:
-            switch (ntf->rf_intf) {
-            case NCI_RF_INTERFACE_FRAME:
-                /* Type 2 Tag */
-                return mode_param_match_poll_a_t2(&mp1->poll_a, &mp2->poll_a);
-            case NCI_RF_INTERFACE_ISO_DEP:
-                /* ISO-DEP Type 4A */
-                return mode_param_match_poll_a(&mp1->poll_a, &mp2->poll_a);
-            case NCI_RF_INTERFACE_NFCEE_DIRECT:
-            case NCI_RF_INTERFACE_NFC_DEP:
-            case NCI_RF_INTERFACE_PROPRIETARY:
-                break;
-            }
-            break;
-        case NCI_MODE_PASSIVE_POLL_B:
-            switch (ntf->rf_intf) {
-            case NCI_RF_INTERFACE_ISO_DEP:
-                /* ISO-DEP Type 4B */
-                return mode_param_match_poll_b(&mp1->poll_b, &mp2->poll_b);
-            case NCI_RF_INTERFACE_FRAME:
-            case NCI_RF_INTERFACE_NFCEE_DIRECT:
-            case NCI_RF_INTERFACE_NFC_DEP:
-            case NCI_RF_INTERFACE_PROPRIETARY:
-                break;
-            }
-            break;
-        case NCI_MODE_ACTIVE_POLL_A:
-        case NCI_MODE_PASSIVE_POLL_F:
-        case NCI_MODE_ACTIVE_POLL_F:
-        case NCI_MODE_PASSIVE_POLL_15693:
-        case NCI_MODE_PASSIVE_LISTEN_A:
-        case NCI_MODE_PASSIVE_LISTEN_B:
-        case NCI_MODE_PASSIVE_LISTEN_F:
-        case NCI_MODE_ACTIVE_LISTEN_A:
-        case NCI_MODE_ACTIVE_LISTEN_F:
-        case NCI_MODE_PASSIVE_LISTEN_15693:
-            break;
+    if (write) {
+        priv->t2_write = NULL;
+        nci_target_t2_cancel_write(nci_target_t2(target), write->id);
+        if (write->done) {
+            write->done(self, FALSE, 0, write->user_data);
         }
+        g_slice_free(NciAdapterT2Write, write);
     }
-    /* Full match is expected in other cases */
-    return info->mode_param.size == ntf->mode_param_len &&
-        (!ntf->mode_param_len || !memcmp(info->mode_param.bytes,
-            ntf->mode_param_bytes, ntf->mode_param_len));
 }
 
 static
-gboolean
-nci_adapter_intf_info_matches(
-    const NciAdapterIntfInfo* info,
-    const NciIntfActivationNtf* ntf)
+void
+nci_adapter_t2_write_done(
+    NfcTarget* target,
+    gboolean ok,
+    guint written,
+    void* user_data)
 {
-    return info &&
-        info->rf_intf == ntf->rf_intf &&
-        info->protocol == ntf->protocol &&
-        info->mode == ntf->mode &&
-        nci_adapter_info_mode_params_matches(info, ntf) &&
-        info->activation_param.size == ntf->activation_param_len &&
-        (!ntf->activation_param_len || !memcmp(info->activation_param.bytes,
-        ntf->activation_param_bytes, ntf->activation_param_len));
+    NciAdapter* self = THIS(user_data);
+    NciAdapterPriv* priv = self->priv;
+    NciAdapterT2Write* write = priv->t2_write;
+
+    /* Synchronous failure is handled by nci_adapter_t2_write() */
+    if (write->id) {
+        priv->t2_write = NULL;
+        if (write->done) {
+            write->done(self, ok, written, write->user_data);
+        }
+        g_slice_free(NciAdapterT2Write, write);
+    }
 }
 
 static
@@ -288,25 +408,127 @@ nci_adapter_drop_target(
 
         self->target = NULL;
         priv->reactivating = FALSE;
+        priv->reactivate_start = 0;
+        if (priv->grace_timer) {
+            g_source_remove(priv->grace_timer);
+            priv->grace_timer = 0;
+        }
+        if (priv->reactivate_timer) {
+            g_source_remove(priv->reactivate_timer);
+            priv->reactivate_timer = 0;
+        }
         if (priv->presence_check_timer) {
             g_source_remove(priv->presence_check_timer);
             priv->presence_check_timer = 0;
         }
         if (priv->presence_check_id) {
-            nfc_target_cancel_transmit(target, priv->presence_check_id);
+            nci_target_cancel_presence_check(target, priv->presence_check_id);
             priv->presence_check_id = 0;
         }
         if (priv->active_intf) {
-            g_free(priv->active_intf->mode_param_parsed);
-            g_free(priv->active_intf);
+            nci_adapter_intf_info_free(priv, priv->active_intf);
             priv->active_intf = NULL;
         }
+        nci_adapter_t2_write_abort(self, target);
         GINFO("Target is gone");
         nfc_target_gone(target);
         nfc_target_unref(target);
     }
 }
 
+static
+void
+nci_adapter_apdu_stats_dump(
+    const NciAdapterApduStats* stats,
+    const char* name,
+    guint id)
+{
+    if (stats->near_misses || stats->late) {
+        GDEBUG("%s %u: %u APDU(s), %u near miss(es), %u late", name, id,
+            stats->count, stats->near_misses, stats->late);
+    }
+}
+
+static
+void
+nci_adapter_aid_route_free(
+    gpointer data)
+{
+    NciAdapterAidRoute* route = data;
+
+    nci_adapter_apdu_stats_dump(&route->stats, "AID route", route->id);
+    g_slice_free(NciAdapterAidRoute, route);
+}
+
+static
+gboolean
+nci_adapter_t4_ndef_apdu(
+    NciAdapter* self,
+    NfcInitiator* initiator,
+    const void* apdu,
+    guint len,
+    void* user_data)
+{
+    NciAdapterPriv* priv = self->priv;
+
+    /* Straight from the data packet handler, no allocations */
+    return initiator == priv->initiator &&
+        nci_initiator_respond_apdu_bytes(initiator,
+            nci_t4_ndef_process(priv->t4_ndef, apdu, len));
+}
+
+static
+gboolean
+nci_adapter_uid_filter_pass(
+    NciAdapterPriv* priv,
+    const NciIntfActivationNtf* ntf)
+{
+    const NciModeParam* mp = ntf->mode_param;
+    const guint8* uid = NULL;
+    guint len = 0;
+
+    if (!priv->uid_filter) {
+        return TRUE;
+    }
+
+    if (mp) {
+        switch (ntf->mode) {
+        case NCI_MODE_PASSIVE_POLL_A:
+        case NCI_MODE_ACTIVE_POLL_A:
+            uid = mp->poll_a.nfcid1;
+            len = mp->poll_a.nfcid1_len;
+            break;
+        case NCI_MODE_PASSIVE_POLL_B:
+            uid = mp->poll_b.nfcid0;
+            len = sizeof(mp->poll_b.nfcid0);
+            break;
+        case NCI_MODE_PASSIVE_POLL_F:
+        case NCI_MODE_ACTIVE_POLL_F:
+            uid = mp->poll_f.nfcid2;
+            len = sizeof(mp->poll_f.nfcid2);
+            break;
+        case NCI_MODE_PASSIVE_POLL_15693:
+        case NCI_MODE_PASSIVE_LISTEN_A:
+        case NCI_MODE_PASSIVE_LISTEN_B:
+        case NCI_MODE_PASSIVE_LISTEN_F:
+        case NCI_MODE_ACTIVE_LISTEN_A:
+        case NCI_MODE_ACTIVE_LISTEN_F:
+        case NCI_MODE_PASSIVE_LISTEN_15693:
+            break;
+        }
+    }
+
+    switch (priv->uid_filter_type) {
+    case NCI_ADAPTER_UID_FILTER_ALLOW:
+        return nci_uid_filter_contains(priv->uid_filter, uid, len);
+    case NCI_ADAPTER_UID_FILTER_DENY:
+        return !nci_uid_filter_contains(priv->uid_filter, uid, len);
+    case NCI_ADAPTER_UID_FILTER_NONE:
+        break;
+    }
+    return TRUE;
+}
+
 static
 void
 nci_adapter_drop_initiator(
@@ -314,6 +536,8 @@ nci_adapter_drop_initiator(
 {
     NfcInitiator* initiator = priv->initiator;
 
+    priv->aid_route = NULL;
+    nci_t4_ndef_reset(priv->t4_ndef);
     if (initiator) {
         priv->initiator = NULL;
         GINFO("Initiator is gone");
@@ -342,6 +566,97 @@ nci_adapter_need_presence_checks(
     return (intf && intf->protocol != NCI_PROTOCOL_NFC_DEP);
 }
 
+static
+gboolean
+nci_adapter_presence_check_timer(
+    gpointer user_data);
+
+static
+void
+nci_adapter_presence_check_schedule(
+    NciAdapter* self)
+{
+    NciAdapterPriv* priv = self->priv;
+    NciAdapterClass* klass = NCI_ADAPTER_GET_CLASS(self);
+    guint ms = klass->presence_check_period(self, priv->active_intf->protocol,
+        priv->presence_check_count);
+
+    if (!ms) {
+        ms = PRESENCE_CHECK_PERIOD_MS;
+    }
+    if (priv->presence_check_timer) {
+        g_source_remove(priv->presence_check_timer);
+    }
+    priv->presence_check_period = ms;
+    priv->presence_check_window = g_get_monotonic_time();
+    if (ms % 1000) {
+        priv->presence_check_timer = g_timeout_add(ms,
+            nci_adapter_presence_check_timer, self);
+    } else {
+        /* Whole seconds, let glib batch it together with other timers */
+        priv->presence_check_timer = g_timeout_add_seconds(ms / 1000,
+            nci_adapter_presence_check_timer, self);
+    }
+}
+
+static
+gboolean
+nci_adapter_grace_timeout(
+    gpointer user_data)
+{
+    NciAdapter* self = THIS(user_data);
+
+    GDEBUG("Target hasn't come back");
+    self->priv->grace_timer = 0;
+    nci_adapter_drop_target(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+gboolean
+nci_adapter_reactivate_timeout(
+    gpointer user_data)
+{
+    NciAdapter* self = THIS(user_data);
+
+    /* Otherwise the target would be stuck in the lost state forever */
+    GDEBUG("Reactivation timed out");
+    self->priv->reactivate_timer = 0;
+    nci_adapter_drop_target(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+gboolean
+nci_adapter_target_lost(
+    NciAdapter* self,
+    NfcTarget* target)
+{
+    NciAdapterPriv* priv = self->priv;
+    NciAdapterClass* klass = NCI_ADAPTER_GET_CLASS(self);
+    NciCore* nci = self->nci;
+    /* Without a stable NFCID there's no telling whether it's back */
+    const guint ms = (self->target == target && priv->active_intf &&
+        priv->active_intf->nfcid_len && !priv->reactivating &&
+        self->parent.powered && nci->current_state == NCI_RFST_POLL_ACTIVE) ?
+        klass->target_grace_period(self, priv->active_intf->protocol) : 0;
+
+    if (ms) {
+        /* Keep the target and wait for it to reappear */
+        GDEBUG("Target is lost, waiting %u ms for it to come back", ms);
+        if (priv->presence_check_timer) {
+            g_source_remove(priv->presence_check_timer);
+            priv->presence_check_timer = 0;
+        }
+        priv->reactivating = TRUE;
+        priv->grace_timer = g_timeout_add(ms, nci_adapter_grace_timeout, self);
+        nci_target_set_lost(target, TRUE);
+        nci_core_set_state(nci, NCI_RFST_DISCOVERY);
+        return TRUE;
+    }
+    return FALSE;
+}
+
 static
 void
 nci_adapter_presence_check_done(
@@ -355,7 +670,15 @@ nci_adapter_presence_check_done(
     GDEBUG("Presence check %s", ok ? "ok" : "failed");
     priv->presence_check_id = 0;
     if (!ok) {
-        nci_adapter_deactivate_target(self, target);
+        if (!nci_adapter_target_lost(self, target)) {
+            nci_adapter_deactivate_target(self, target);
+        }
+    } else if (self->target == target && !priv->reactivating &&
+        nci_adapter_need_presence_checks(self)) {
+        if (priv->presence_check_count < G_MAXUINT) {
+            priv->presence_check_count++;
+        }
+        nci_adapter_presence_check_schedule(self);
     }
 }
 
@@ -366,20 +689,29 @@ nci_adapter_presence_check_timer(
 {
     NciAdapter* self = THIS(user_data);
     NciAdapterPriv* priv = self->priv;
+    NfcTarget* target = self->target;
 
-    if (!priv->presence_check_id && !self->target->sequence) {
-        priv->presence_check_id = nci_target_presence_check(self->target,
+    priv->presence_check_timer = 0;
+    if (nci_target_last_transmit_ok(target) >= priv->presence_check_window) {
+        /* Successful traffic is as good a proof as any presence check */
+        GDEBUG("Target is talking, no need to check");
+        if (priv->presence_check_count < G_MAXUINT) {
+            priv->presence_check_count++;
+        }
+        nci_adapter_presence_check_schedule(self);
+    } else if (!priv->presence_check_id && !target->sequence) {
+        /* The next check gets scheduled when this one completes */
+        priv->presence_check_id = nci_target_presence_check(target,
             nci_adapter_presence_check_done, self);
         if (!priv->presence_check_id) {
             GDEBUG("Failed to start presence check");
-            priv->presence_check_timer = 0;
             nci_core_set_state(self->nci, NCI_RFST_DISCOVERY);
-            return G_SOURCE_REMOVE;
         }
     } else {
         GDEBUG("Skipped presence check");
+        nci_adapter_presence_check_schedule(self);
     }
-    return G_SOURCE_CONTINUE;
+    return G_SOURCE_REMOVE;
 }
 
 static
@@ -389,7 +721,8 @@ nci_adapter_mode_check(
 {
     NciCore* nci = self->nci;
     NciAdapterPriv* priv = self->priv;
-    const NFC_MODE mode = (nci->current_state > NCI_RFST_IDLE) ?
+    const NFC_MODE mode = (nci->current_state > NCI_RFST_IDLE ||
+        priv->discovery_hold_id || priv->listen_routes_idle) ?
         ((priv->current_mode == NFC_MODE_NONE) ? priv->desired_mode :
         priv->current_mode) : NFC_MODE_NONE;
 
@@ -433,37 +766,300 @@ nci_adapter_schedule_mode_check(
     }
 }
 
+static
+gboolean
+nci_adapter_listen_mode_routing_timeout(
+    gpointer user_data)
+{
+    NciAdapter* self = THIS(user_data);
+
+    GWARN("Listen mode routing timed out");
+    nci_adapter_listen_mode_routing_done(self, FALSE);
+    return G_SOURCE_REMOVE;
+}
+
 static
 void
-nci_adapter_state_check(
+nci_adapter_set_listen_mode_routing(
     NciAdapter* self)
 {
-    NciCore* nci = self->nci;
-
-    if (nci->current_state == NCI_RFST_IDLE &&
-        nci->next_state == NCI_RFST_IDLE) {
-        NfcAdapter* adapter = &self->parent;
+    NciAdapterClass* klass = NCI_ADAPTER_GET_CLASS(self);
+    NciAdapterPriv* priv = self->priv;
+    GPtrArray* routes = priv->listen_routes;
+    GByteArray* buf = g_byte_array_new();
+    GArray* offsets = g_array_new(FALSE, FALSE, sizeof(guint));
+    GUtilData* payloads;
+    guint i, n, count = 0, start = 0;
+    int type;
 
-        if (adapter->powered && adapter->enabled) {
-            /*
-             * State machine may have switched to RFST_IDLE in the process of
-             * changing the operation mode. Kick it back to RFST_DISCOVERY.
-             */
-            nci_core_set_state(self->nci, NCI_RFST_DISCOVERY);
+    /*
+     * RF_SET_LISTEN_MODE_ROUTING_CMD payload:
+     *
+     * +--------------------------------------------------------+
+     * | More (1) | Number of Routing Entries (1) | Entries ... |
+     * +--------------------------------------------------------+
+     *
+     * Routing Entry: Type (1) | Length (1) | NFCEE | Power State | Value
+     *
+     * The table may need to be split into several commands.
+     */
+    g_byte_array_set_size(buf, 2);
+    for (type = 0; type < ROUTE_TYPE_COUNT; type++) {
+        for (i = 0; routes && i < routes->len; i++) {
+            const NciAdapterListenRoute* route = routes->pdata[i];
+
+            if (route->type == type) {
+                const guint size = 4 + route->len;
+                guint8 hdr[4];
+
+                if (buf->len - start + size > ROUTING_CMD_MAX_PAYLOAD) {
+                    buf->data[start] = 0x01; /* More */
+                    buf->data[start + 1] = count;
+                    g_array_append_val(offsets, start);
+                    start = buf->len;
+                    count = 0;
+                    g_byte_array_set_size(buf, start + 2);
+                }
+                hdr[0] = route_entry_type[type];
+                hdr[1] = 2 + route->len;
+                hdr[2] = route->nfcee;
+                hdr[3] = route->power;
+                g_byte_array_append(buf, hdr, sizeof(hdr));
+                g_byte_array_append(buf, route->value, route->len);
+                count++;
+            }
         }
     }
+    buf->data[start] = 0x00; /* Last one */
+    buf->data[start + 1] = count;
+    g_array_append_val(offsets, start);
+
+    n = offsets->len;
+    payloads = g_new(GUtilData, n);
+    for (i = 0; i < n; i++) {
+        const guint off = g_array_index(offsets, guint, i);
+        const guint end = (i + 1 < n) ?
+            g_array_index(offsets, guint, i + 1) : buf->len;
+
+        payloads[i].bytes = buf->data + off;
+        payloads[i].size = end - off;
+    }
+
+    priv->listen_routes_dirty = FALSE;
+    if (klass->set_listen_mode_routing(self, payloads, n)) {
+        /* NciCore stays in RFST_IDLE until the last RSP arrives */
+        GDEBUG("Updating listen mode routing, %u route(s)", routes ?
+            routes->len : 0);
+        priv->listen_routes_timer = g_timeout_add(ROUTING_TIMEOUT_MS,
+            nci_adapter_listen_mode_routing_timeout, self);
+    } else {
+        GDEBUG("Failed to update listen mode routing");
+    }
+    g_free(payloads);
+    g_array_free(offsets, TRUE);
+    g_byte_array_free(buf, TRUE);
 }
 
 static
-const NfcParamPollA*
-nci_adapter_convert_poll_a(
-    NfcParamPollA* dest,
-    const NciModeParam* mp)
+void
+nci_adapter_update_supported_modes(
+    NciAdapter* self)
 {
-    if (mp) {
-        const NciModeParamPollA* src = &mp->poll_a;
+    NfcAdapter* adapter = &self->parent;
 
-        dest->sel_res = src->sel_res;
+    /* Card emulation is only advertised when there's something to emulate */
+    if (nci_adapter_apdu_handler_set(self) || nci_adapter_t3t_store(self)) {
+        adapter->supported_modes |= NFC_MODE_CARD_EMILATION;
+    } else {
+        adapter->supported_modes &= ~NFC_MODE_CARD_EMILATION;
+    }
+}
+
+static
+void
+nci_adapter_discovery_hold_reset(
+    NciAdapterPriv* priv)
+{
+    if (priv->discovery_hold_id) {
+        g_source_remove(priv->discovery_hold_id);
+        priv->discovery_hold_id = 0;
+    }
+    if (priv->unsupported) {
+        g_hash_table_remove_all(priv->unsupported);
+    }
+}
+
+static
+void
+nci_adapter_state_check(
+    NciAdapter* self)
+{
+    NciCore* nci = self->nci;
+    NciAdapterPriv* priv = self->priv;
+
+    /* Nobody is waiting for discovery, forget the backoff */
+    if (nci->current_state == NCI_RFST_IDLE &&
+        !(self->parent.powered && self->parent.enabled)) {
+        nci_adapter_discovery_hold_reset(priv);
+    }
+
+    /* Routing is programmed again after power up */
+    if (nci->current_state == NCI_RFST_IDLE && !self->parent.powered) {
+        if (priv->listen_routes_timer) {
+            g_source_remove(priv->listen_routes_timer);
+            priv->listen_routes_timer = 0;
+            priv->listen_routes_dirty = TRUE;
+        }
+        priv->listen_routes_idle = FALSE;
+    }
+
+    if (priv->listen_routes_timer) {
+        /* RF_DISCOVER_CMD must wait for the routing commands to complete */
+        return;
+    }
+
+    /* Without support from the derived class NFCC routes everything */
+    if (!NCI_ADAPTER_GET_CLASS(self)->set_listen_mode_routing) {
+        priv->listen_routes_dirty = FALSE;
+    }
+
+    /* Routing can only be changed in RFST_IDLE */
+    if (priv->listen_routes_dirty && self->parent.powered &&
+        nci->current_state == nci->next_state) {
+        if (nci->current_state == NCI_RFST_IDLE) {
+            nci_adapter_set_listen_mode_routing(self);
+            if (priv->listen_routes_timer) {
+                return;
+            }
+        } else if (nci->current_state == NCI_RFST_DISCOVERY) {
+            GDEBUG("Stopping discovery to update routing");
+            priv->listen_routes_idle = TRUE;
+            nci_core_set_state(nci, NCI_RFST_IDLE);
+            return;
+        }
+    }
+    if (nci->current_state > NCI_RFST_IDLE) {
+        priv->listen_routes_idle = FALSE;
+    }
+
+    if (nci->current_state == NCI_RFST_IDLE &&
+        nci->next_state == NCI_RFST_IDLE &&
+        !self->priv->discovery_hold_id) {
+        NfcAdapter* adapter = &self->parent;
+
+        if (adapter->powered && adapter->enabled) {
+            /*
+             * State machine may have switched to RFST_IDLE in the process of
+             * changing the operation mode. Kick it back to RFST_DISCOVERY.
+             */
+            nci_core_set_state(self->nci, NCI_RFST_DISCOVERY);
+        } else {
+            /* Not going back to discovery after all */
+            priv->listen_routes_idle = FALSE;
+        }
+    }
+}
+
+static
+gboolean
+nci_adapter_discovery_hold_timeout(
+    gpointer user_data)
+{
+    NciAdapter* self = THIS(user_data);
+
+    GDEBUG("Resuming discovery");
+    self->priv->discovery_hold_id = 0;
+    nci_adapter_state_check(self);
+    nci_adapter_mode_check(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+nci_adapter_unsupported_evict(
+    GHashTable* table)
+{
+    NciAdapterUnsupported* oldest = NULL;
+    GHashTableIter it;
+    gpointer value;
+
+    /* The table is small, a linear scan is fine */
+    g_hash_table_iter_init(&it, table);
+    while (g_hash_table_iter_next(&it, NULL, &value)) {
+        NciAdapterUnsupported* entry = value;
+
+        if (!oldest || entry->last_seen < oldest->last_seen) {
+            oldest = entry;
+        }
+    }
+    if (oldest) {
+        g_hash_table_remove(table, &oldest->fp);
+    }
+}
+
+static
+void
+nci_adapter_unsupported(
+    NciAdapter* self,
+    const NciFingerprint* fp)
+{
+    NciAdapterPriv* priv = self->priv;
+    const gint64 now = g_get_monotonic_time();
+    NciAdapterUnsupported* entry = NULL;
+
+    priv->unsupported_count++;
+    if (priv->unsupported) {
+        entry = g_hash_table_lookup(priv->unsupported, fp);
+    } else {
+        priv->unsupported = g_hash_table_new_full(nci_fingerprint_hash,
+            nci_fingerprint_equal, NULL, g_free);
+    }
+
+    if (entry && (now - entry->last_seen) < UNSUPPORTED_FORGET_MS * 1000) {
+        guint ms = UNSUPPORTED_BACKOFF_MIN_MS;
+        guint n = entry->count++;
+
+        /* The same thing again, back off exponentially */
+        entry->last_seen = now;
+        while (--n > 0 && ms < UNSUPPORTED_BACKOFF_MAX_MS) {
+            ms *= 2;
+        }
+        ms = MIN(ms, UNSUPPORTED_BACKOFF_MAX_MS);
+        GDEBUG("Seen it %u times, holding discovery for %u ms",
+            entry->count, ms);
+        if (priv->discovery_hold_id) {
+            g_source_remove(priv->discovery_hold_id);
+        }
+        priv->discovery_hold_id = g_timeout_add(ms,
+            nci_adapter_discovery_hold_timeout, self);
+        priv->discovery_hold_count++;
+        priv->discovery_hold_ms += ms;
+    } else {
+        /* First time (or long time ago), give it another chance */
+        if (!entry) {
+            if (g_hash_table_size(priv->unsupported) >=
+                UNSUPPORTED_CACHE_SIZE) {
+                nci_adapter_unsupported_evict(priv->unsupported);
+            }
+            entry = g_new(NciAdapterUnsupported, 1);
+            entry->fp = *fp;
+            g_hash_table_insert(priv->unsupported, &entry->fp, entry);
+        }
+        entry->count = 1;
+        entry->last_seen = now;
+    }
+}
+
+static
+const NfcParamPollA*
+nci_adapter_convert_poll_a(
+    NfcParamPollA* dest,
+    const NciModeParam* mp)
+{
+    if (mp) {
+        const NciModeParamPollA* src = &mp->poll_a;
+
+        dest->sel_res = src->sel_res;
         dest->nfcid1.bytes = src->nfcid1;
         dest->nfcid1.size = src->nfcid1_len;
         return dest;
@@ -588,16 +1184,131 @@ nci_adapter_convert_nfc_dep_listen(
     return dest;
 }
 
+static
+void
+nci_adapter_intf_info_keep(
+    NciAdapterIntfInfo* info,
+    GUtilData* data)
+{
+    /* Converted parameters must not point into the notification */
+    if (data->size &&
+        data->size <= sizeof(info->param_data) - info->param_data_used) {
+        guint8* ptr = info->param_data + info->param_data_used;
+
+        memcpy(ptr, data->bytes, data->size);
+        info->param_data_used += data->size;
+        data->bytes = ptr;
+    } else {
+        data->bytes = NULL;
+        data->size = 0;
+    }
+}
+
+static
+const NfcParamPoll*
+nci_adapter_intf_info_poll(
+    NciAdapterPriv* priv,
+    NciAdapterIntfInfo* info,
+    const NciIntfActivationNtf* ntf)
+{
+    if (!(info->params_converted & INTF_PARAM_POLL)) {
+        const NciModeParam* mp = ntf->mode_param;
+        NfcParamPoll* poll = &info->poll_buf;
+
+        info->params_converted |= INTF_PARAM_POLL;
+        switch (ntf->mode) {
+        case NCI_MODE_PASSIVE_POLL_A:
+        case NCI_MODE_ACTIVE_POLL_A:
+            if (nci_adapter_convert_poll_a(&poll->a, mp)) {
+                nci_adapter_intf_info_keep(info, &poll->a.nfcid1);
+                info->poll = poll;
+            }
+            break;
+        case NCI_MODE_PASSIVE_POLL_B:
+            if (nci_adapter_convert_poll_b(&poll->b, mp)) {
+                nci_adapter_intf_info_keep(info, &poll->b.nfcid0);
+                nci_adapter_intf_info_keep(info, &poll->b.prot_info);
+                info->poll = poll;
+            }
+            break;
+        case NCI_MODE_PASSIVE_POLL_F:
+        case NCI_MODE_ACTIVE_POLL_F:
+            if (nci_adapter_convert_poll_f(&poll->f, mp)) {
+                nci_adapter_intf_info_keep(info, &poll->f.nfcid2);
+                info->poll = poll;
+            }
+            break;
+        case NCI_MODE_PASSIVE_POLL_15693:
+        case NCI_MODE_PASSIVE_LISTEN_A:
+        case NCI_MODE_PASSIVE_LISTEN_B:
+        case NCI_MODE_PASSIVE_LISTEN_F:
+        case NCI_MODE_ACTIVE_LISTEN_A:
+        case NCI_MODE_ACTIVE_LISTEN_F:
+        case NCI_MODE_PASSIVE_LISTEN_15693:
+            break;
+        }
+        if (info->poll) {
+            priv->param_count++;
+        }
+    }
+    return info->poll;
+}
+
+static
+const NfcParamIsoDepPollA*
+nci_adapter_intf_info_iso_dep_poll_a(
+    NciAdapterPriv* priv,
+    NciAdapterIntfInfo* info,
+    const NciIntfActivationNtf* ntf)
+{
+    if (!(info->params_converted & INTF_PARAM_ISO_DEP_POLL_A)) {
+        info->params_converted |= INTF_PARAM_ISO_DEP_POLL_A;
+        if (ntf->activation_param) {
+            NfcParamIsoDepPollA* iso_dep = &info->iso_dep_poll_a_buf;
+
+            nci_adapter_convert_iso_dep_poll_a(iso_dep,
+                &ntf->activation_param->iso_dep_poll_a);
+            nci_adapter_intf_info_keep(info, &iso_dep->t1);
+            info->iso_dep_poll_a = iso_dep;
+            priv->param_count++;
+        }
+    }
+    return info->iso_dep_poll_a;
+}
+
+static
+const NfcParamIsoDepPollB*
+nci_adapter_intf_info_iso_dep_poll_b(
+    NciAdapterPriv* priv,
+    NciAdapterIntfInfo* info,
+    const NciIntfActivationNtf* ntf)
+{
+    if (!(info->params_converted & INTF_PARAM_ISO_DEP_POLL_B)) {
+        info->params_converted |= INTF_PARAM_ISO_DEP_POLL_B;
+        if (ntf->activation_param) {
+            NfcParamIsoDepPollB* iso_dep = &info->iso_dep_poll_b_buf;
+
+            nci_adapter_convert_iso_dep_poll_b(iso_dep,
+                &ntf->activation_param->iso_dep_poll_b);
+            nci_adapter_intf_info_keep(info, &iso_dep->hlr);
+            info->iso_dep_poll_b = iso_dep;
+            priv->param_count++;
+        }
+    }
+    return info->iso_dep_poll_b;
+}
+
 static
 NfcTag*
 nci_adapter_create_known_tag(
-    NfcAdapter* adapter,
+    NciAdapter* self,
     NfcTarget* target,
     const NciIntfActivationNtf* ntf)
 {
-    const NciModeParam* mp = ntf->mode_param;
-    NfcParamPollA poll_a;
-    NfcParamPollB poll_b;
+    NfcAdapter* adapter = NFC_ADAPTER(self);
+    NciAdapterPriv* priv = self->priv;
+    NciAdapterIntfInfo* info = priv->active_intf;
+    const NfcParamPoll* poll;
 
     /* Figure out what kind of target we are dealing with */
     switch (ntf->protocol) {
@@ -607,8 +1318,9 @@ nci_adapter_create_known_tag(
             case NCI_MODE_PASSIVE_POLL_A:
             case NCI_MODE_ACTIVE_POLL_A:
                 /* Type 2 Tag */
+                poll = nci_adapter_intf_info_poll(priv, info, ntf);
                 return nfc_adapter_add_tag_t2(adapter, target,
-                    nci_adapter_convert_poll_a(&poll_a, mp));
+                    poll ? &poll->a : NULL);
             case NCI_MODE_PASSIVE_POLL_B:
             case NCI_MODE_PASSIVE_POLL_F:
             case NCI_MODE_ACTIVE_POLL_F:
@@ -629,25 +1341,19 @@ nci_adapter_create_known_tag(
             case NCI_MODE_PASSIVE_POLL_A:
                 /* ISO-DEP Type 4A */
                 if (ntf->activation_param) {
-                    const NciActivationParam* ap = ntf->activation_param;
-                    NfcParamIsoDepPollA iso_dep_poll_a;
-
+                    poll = nci_adapter_intf_info_poll(priv, info, ntf);
                     return nfc_adapter_add_tag_t4a(adapter, target,
-                        nci_adapter_convert_poll_a(&poll_a, mp),
-                        nci_adapter_convert_iso_dep_poll_a(&iso_dep_poll_a,
-                            &ap->iso_dep_poll_a));
+                        poll ? &poll->a : NULL,
+                        nci_adapter_intf_info_iso_dep_poll_a(priv, info, ntf));
                 }
                 break;
             case NCI_MODE_PASSIVE_POLL_B:
                 /* ISO-DEP Type 4B */
                 if (ntf->activation_param) {
-                    const NciActivationParam* ap = ntf->activation_param;
-                    NfcParamIsoDepPollB iso_dep_poll_b;
-
+                    poll = nci_adapter_intf_info_poll(priv, info, ntf);
                     return nfc_adapter_add_tag_t4b(adapter, target,
-                        nci_adapter_convert_poll_b(&poll_b, mp),
-                        nci_adapter_convert_iso_dep_poll_b(&iso_dep_poll_b,
-                            &ap->iso_dep_poll_b));
+                        poll ? &poll->b : NULL,
+                        nci_adapter_intf_info_iso_dep_poll_b(priv, info, ntf));
                 }
                 break;
             case NCI_MODE_ACTIVE_POLL_A:
@@ -791,23 +1497,16 @@ nci_adapter_create_peer_target(
 static
 const NfcParamPoll*
 nci_adapter_get_mode_param(
-    NfcParamPoll* poll,
+    NciAdapter* self,
     const NciIntfActivationNtf* ntf)
 {
-    const NciModeParam* mp = ntf->mode_param;
+    NciAdapterPriv* priv = self->priv;
 
     /* Figure out what kind of target we are dealing with */
     switch (ntf->mode) {
     case NCI_MODE_PASSIVE_POLL_A:
-        if (nci_adapter_convert_poll_a(&poll->a, mp)) {
-            return poll;
-        }
-        break;
     case NCI_MODE_PASSIVE_POLL_B:
-        if (nci_adapter_convert_poll_b(&poll->b, mp)) {
-            return poll;
-        }
-        break;
+        return nci_adapter_intf_info_poll(priv, priv->active_intf, ntf);
     case NCI_MODE_ACTIVE_POLL_A:
     case NCI_MODE_PASSIVE_POLL_F:
     case NCI_MODE_ACTIVE_POLL_F:
@@ -833,21 +1532,68 @@ nci_adapter_nci_intf_activated(
     NciAdapter* self = THIS(user_data);
     NciAdapterPriv* priv = self->priv;
     NfcTarget* reactivated = NULL;
+    NciFingerprint fp;
 
     nci_adapter_drop_initiator(priv);
+    if (ntf->rf_intf == NCI_RF_INTERFACE_NFCEE_DIRECT) {
+        /* NFCC talks to NFCEE, nothing for us to do here */
+        GDEBUG("Activated with NFCEE Direct RF interface");
+        priv->nfcee_activations++;
+        nci_adapter_drop_target(self);
+        return;
+    }
+
+    /* Computed once, shared by everything below */
+    nci_fingerprint_init(&fp, ntf);
     if (!priv->reactivating) {
         /* Drop the previous target, if any */
         nci_adapter_drop_target(self);
     } else if (self->target &&
-        !nci_adapter_intf_info_matches(priv->active_intf, ntf)) {
+        (!nci_adapter_intf_info_matches(priv, priv->active_intf, &fp) ||
+         (priv->grace_timer &&
+          !nci_adapter_intf_info_same_nfcid(priv->active_intf, ntf)))) {
+        /* Reusing the lost target requires the exact same NFCID */
         GDEBUG("Different tag has arrived, dropping the old one");
         nci_adapter_drop_target(self);
     }
 
+    /* Reject unwanted targets (Poll modes don't have bit 7 set) */
+    if (!self->target && !(ntf->mode & 0x80) &&
+        !nci_adapter_uid_filter_pass(priv, ntf)) {
+        GDEBUG("Rejected by UID filter");
+        priv->uid_filter_rejected++;
+        /* Don't keep reactivating the same card over and over again */
+        nci_adapter_unsupported(self, &fp);
+        nci_core_set_state(nci, NCI_RFST_IDLE);
+        return;
+    }
+
     if (self->target) {
         /* The same target has arrived or we have been woken up */
         priv->reactivating = FALSE;
         reactivated = self->target;
+        if (priv->reactivate_start) {
+            const int path = priv->reactivating_fast ?
+                REACTIVATE_PATH_SLEEP_SELECT : REACTIVATE_PATH_DISCOVERY;
+            const gint64 us = g_get_monotonic_time() - priv->reactivate_start;
+
+            priv->reactivate_start = 0;
+            priv->reactivate_count[path]++;
+            priv->reactivate_time[path] += us;
+            GDEBUG("Reactivation (%s) took %u.%03u ms",
+                reactivate_path_name[path], (guint)(us / 1000),
+                (guint)(us % 1000));
+        }
+        if (priv->grace_timer) {
+            GINFO("Target is back");
+            g_source_remove(priv->grace_timer);
+            priv->grace_timer = 0;
+        }
+        if (priv->reactivate_timer) {
+            g_source_remove(priv->reactivate_timer);
+            priv->reactivate_timer = 0;
+        }
+        nci_target_set_lost(reactivated, FALSE);
     } else {
         NfcAdapter* adapter = NFC_ADAPTER(self);
         NfcTarget* target = self->target = nci_target_new(self, ntf);
@@ -860,27 +1606,26 @@ nci_adapter_nci_intf_activated(
                 NfcTag* tag = NULL;
 
                /* Otherwise assume a tag */
-                priv->active_intf = nci_adapter_intf_info_new(ntf);
+                priv->active_intf = nci_adapter_intf_info_new(priv, ntf,
+                    &fp);
                 if (ntf->mode_param) {
-                    tag = nci_adapter_create_known_tag(adapter, target, ntf);
+                    tag = nci_adapter_create_known_tag(self, target, ntf);
                 }
                 if (!tag) {
-                    NfcParamPoll poll;
-
                     nfc_adapter_add_other_tag2(adapter, target,
-                        nci_adapter_get_mode_param(&poll, ntf));
+                        nci_adapter_get_mode_param(self, ntf));
                 }
             }
-        } else if (initiator) {
-            /* We don't support card emulation (yet), assume a peer */
+        } else if (initiator && initiator->protocol == NFC_PROTOCOL_NFC_DEP) {
+            /* Otherwise it's card emulation, handled by the adapter */
             nci_adapter_create_peer_target(adapter, initiator, ntf);
         }
     }
 
     /* Start periodic presence checks */
     if (nci_adapter_need_presence_checks(self)) {
-        priv->presence_check_timer = g_timeout_add(PRESENCE_CHECK_PERIOD_MS,
-            nci_adapter_presence_check_timer, self);
+        priv->presence_check_count = 0;
+        nci_adapter_presence_check_schedule(self);
     }
 
     /* Notify the core that target has beed reactivated */
@@ -892,10 +1637,77 @@ nci_adapter_nci_intf_activated(
     /* If we don't know what this is, switch back to DISCOVERY */
     if (!self->target && !priv->initiator) {
         GDEBUG("No idea what this is");
+        /* Don't rush back to discovery if it keeps happening */
+        nci_adapter_unsupported(self, &fp);
         nci_core_set_state(nci, NCI_RFST_IDLE);
     }
 }
 
+static
+NciConn*
+nci_adapter_find_conn(
+    NciAdapterPriv* priv,
+    guint conn_id,
+    guint* index)
+{
+    GPtrArray* conns = priv->conns;
+    guint i;
+
+    for (i = 0; conns && i < conns->len; i++) {
+        NciConn* conn = conns->pdata[i];
+
+        if (nci_conn_id(conn) == conn_id) {
+            if (index) {
+                *index = i;
+            }
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+static
+NciConn*
+nci_adapter_find_cid(
+    NciAdapterPriv* priv,
+    guint8 cid,
+    guint* index)
+{
+    GPtrArray* conns = priv->conns;
+    guint i;
+
+    for (i = 0; conns && i < conns->len; i++) {
+        NciConn* conn = conns->pdata[i];
+
+        if (nci_conn_has_cid(conn, cid)) {
+            if (index) {
+                *index = i;
+            }
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+static
+void
+nci_adapter_nci_data_packet(
+    NciCore* nci,
+    guint8 cid,
+    const void* data,
+    guint len,
+    void* user_data)
+{
+    if (cid != NCI_STATIC_RF_CONN_ID) {
+        NciAdapter* self = THIS(user_data);
+        NciConn* conn = nci_adapter_find_cid(self->priv, cid, NULL);
+
+        if (conn) {
+            nci_conn_data(conn, data, len);
+        }
+    }
+}
+
 static
 void
 nci_adapter_nci_next_state_changed(
@@ -941,6 +1753,9 @@ nci_adapter_init_base(
     priv->nci_event_id[CORE_EVENT_INTF_ACTIVATED] =
         nci_core_add_intf_activated_handler(self->nci,
             nci_adapter_nci_intf_activated, self);
+    priv->nci_event_id[CORE_EVENT_DATA_PACKET] =
+        nci_core_add_data_packet_handler(self->nci,
+            nci_adapter_nci_data_packet, self);
 }
 
 /*
@@ -959,6 +1774,17 @@ nci_adapter_finalize_core(
         g_source_remove(priv->mode_check_id);
         priv->mode_check_id = 0;
     }
+    if (priv->conns) {
+        GPtrArray* conns = priv->conns;
+        guint i;
+
+        /* Connections may have data pending in NciCore */
+        priv->conns = NULL;
+        for (i = 0; i < conns->len; i++) {
+            nci_conn_free(conns->pdata[i]);
+        }
+        g_ptr_array_free(conns, TRUE);
+    }
     if (self->nci) {
         nci_core_remove_all_handlers(self->nci, priv->nci_event_id);
         nci_core_free(self->nci);
@@ -966,68 +1792,767 @@ nci_adapter_finalize_core(
     }
 }
 
-gboolean
-nci_adapter_reactivate(
-    NciAdapter* self,
-    NfcTarget* target)
-{
-    if (self && self->target == target && target) {
-        NciAdapterPriv* priv = self->priv;
-        NciCore* nci = self->nci;
-
-        if (priv->active_intf && !priv->reactivating && nci &&
-            ((nci->current_state == NCI_RFST_POLL_ACTIVE &&
-              nci->next_state == NCI_RFST_POLL_ACTIVE) ||
-             (nci->current_state == NCI_RFST_LISTEN_ACTIVE &&
-              nci->next_state == NCI_RFST_LISTEN_ACTIVE))) {
-            priv->reactivating = TRUE;
-            if (priv->presence_check_timer) {
-                /* Stop presence checks for the time being */
-                g_source_remove(priv->presence_check_timer);
-                priv->presence_check_timer = 0;
-            }
-            /* Switch to discovery and expect the same target to reappear */
-            nci_core_set_state(nci, NCI_RFST_DISCOVERY);
-            return TRUE;
-        }
-    }
-    GWARN("Can't reactivate the tag in this state");
-    return FALSE;
-}
-
 void
-nci_adapter_deactivate_target(
+nci_adapter_iso_dep_nak_presence(
     NciAdapter* self,
-    NfcTarget* target)
+    gboolean present)
 {
-    if (self && self->target == target && target) {
-        nci_adapter_drop_target(self);
-        if (self->parent.powered) {
-            nci_core_set_state(self->nci, NCI_RFST_DISCOVERY);
-        }
+    if (G_LIKELY(self)) {
+        GDEBUG("ISO-DEP NAK presence check %s", present ? "ok" : "failed");
+        nci_target_iso_dep_nak_presence(self->target, present);
     }
 }
 
 void
-nci_adapter_deactivate_initiator(
+nci_adapter_set_apdu_handler(
     NciAdapter* self,
-    NfcInitiator* initiator)
+    NciAdapterApduFunc handler,
+    void* user_data)
 {
-    if (self && initiator) {
+    if (G_LIKELY(self)) {
         NciAdapterPriv* priv = self->priv;
 
-        if (priv->initiator == initiator) {
-            nci_adapter_drop_initiator(priv);
-            if (self->parent.powered) {
-                nci_core_set_state(self->nci, NCI_RFST_DISCOVERY);
-            }
-        }
+        priv->apdu_handler = handler;
+        priv->apdu_handler_data = handler ? user_data : NULL;
+        nci_adapter_update_supported_modes(self);
     }
 }
 
-/*==========================================================================*
- * Methods
- *==========================================================================*/
+gboolean
+nci_adapter_respond_apdu(
+    NciAdapter* self,
+    NfcInitiator* initiator,
+    const void* apdu,
+    guint len)
+{
+    return self && initiator && self->priv->initiator == initiator &&
+        nci_initiator_respond_apdu(initiator, apdu, len);
+}
+
+gboolean
+nci_adapter_respond_apdu_bytes(
+    NciAdapter* self,
+    NfcInitiator* initiator,
+    GBytes* apdu)
+{
+    return self && initiator && apdu && self->priv->initiator == initiator &&
+        nci_initiator_respond_apdu_bytes(initiator, apdu);
+}
+
+guint
+nci_adapter_add_aid_handler(
+    NciAdapter* self,
+    const GUtilData* aid,
+    NCI_ADAPTER_AID_MATCH match,
+    int priority,
+    NciAdapterApduFunc handler,
+    void* user_data)
+{
+    if (G_LIKELY(self) && G_LIKELY(aid) && G_LIKELY(handler)) {
+        NciAdapterPriv* priv = self->priv;
+        NciAdapterAidRoute* route = g_slice_new(NciAdapterAidRoute);
+
+        if (!priv->aid_table) {
+            priv->aid_table = nci_aid_table_new(nci_adapter_aid_route_free);
+        }
+        memset(route, 0, sizeof(*route));
+        route->handler = handler;
+        route->user_data = user_data;
+        route->id = nci_aid_table_add(priv->aid_table, aid->bytes, aid->size,
+            match == NCI_ADAPTER_AID_MATCH_PREFIX, priority, route);
+        if (route->id) {
+            nci_adapter_update_supported_modes(self);
+            return route->id;
+        }
+        nci_adapter_aid_route_free(route);
+    }
+    return 0;
+}
+
+void
+nci_adapter_remove_aid_handler(
+    NciAdapter* self,
+    guint id)
+{
+    if (G_LIKELY(self) && G_LIKELY(id)) {
+        NciAdapterPriv* priv = self->priv;
+
+        if (priv->aid_route && priv->aid_route->id == id) {
+            priv->aid_route = NULL;
+        }
+        nci_aid_table_remove(priv->aid_table, id);
+        nci_adapter_update_supported_modes(self);
+    }
+}
+
+gboolean
+nci_adapter_set_t4_ndef_file(
+    NciAdapter* self,
+    const char* path)
+{
+    if (G_LIKELY(self)) {
+        NciAdapterPriv* priv = self->priv;
+        NciT4Ndef* ndef = NULL;
+
+        if (path) {
+            ndef = nci_t4_ndef_new_from_file(path);
+            if (!ndef) {
+                return FALSE;
+            }
+        }
+        if (priv->t4_ndef_route_id) {
+            nci_adapter_remove_aid_handler(self, priv->t4_ndef_route_id);
+            priv->t4_ndef_route_id = 0;
+        }
+        nci_t4_ndef_free(priv->t4_ndef);
+        priv->t4_ndef = ndef;
+        if (ndef) {
+            static const guint8 aid_bytes[] = { NCI_T4_NDEF_AID };
+            GUtilData aid;
+
+            aid.bytes = aid_bytes;
+            aid.size = sizeof(aid_bytes);
+            priv->t4_ndef_route_id = nci_adapter_add_aid_handler(self, &aid,
+                NCI_ADAPTER_AID_MATCH_EXACT, 0, nci_adapter_t4_ndef_apdu,
+                NULL);
+        }
+        return TRUE;
+    }
+    return FALSE;
+}
+
+gboolean
+nci_adapter_add_t3t_service(
+    NciAdapter* self,
+    guint16 service_code,
+    guint nblocks,
+    const void* data)
+{
+    if (G_LIKELY(self)) {
+        NciAdapterPriv* priv = self->priv;
+
+        if (!priv->t3t_store) {
+            priv->t3t_store = nci_t3t_store_new();
+        }
+        if (nci_t3t_store_add_service(priv->t3t_store, service_code,
+            nblocks, data)) {
+            nci_adapter_update_supported_modes(self);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+const guint8*
+nci_adapter_t3t_block(
+    NciAdapter* self,
+    guint16 service_code,
+    guint block)
+{
+    return G_LIKELY(self) ? nci_t3t_store_block(self->priv->t3t_store,
+        service_code, block) : NULL;
+}
+
+static
+guint
+nci_adapter_add_listen_route(
+    NciAdapter* self,
+    ROUTE_TYPE type,
+    const void* value,
+    guint len,
+    guint8 nfcee,
+    guint8 power)
+{
+    NciAdapterPriv* priv = self->priv;
+    NciAdapterListenRoute* route = g_new0(NciAdapterListenRoute, 1);
+
+    if (!priv->listen_routes) {
+        priv->listen_routes = g_ptr_array_new_with_free_func(g_free);
+    }
+    route->id = ++priv->last_listen_route_id;
+    if (!route->id) {
+        route->id = ++priv->last_listen_route_id;
+    }
+    route->type = type;
+    route->nfcee = nfcee;
+    route->power = power;
+    route->len = len;
+    memcpy(route->value, value, len);
+    g_ptr_array_add(priv->listen_routes, route);
+    priv->listen_routes_dirty = TRUE;
+    nci_adapter_state_check(self);
+    return route->id;
+}
+
+guint
+nci_adapter_add_technology_route(
+    NciAdapter* self,
+    NFC_TECHNOLOGY technology,
+    guint8 nfcee,
+    guint8 power)
+{
+    if (G_LIKELY(self)) {
+        guint8 tech;
+
+        /* NCI RF Technologies */
+        switch (technology) {
+        case NFC_TECHNOLOGY_A:
+            tech = 0x00;
+            break;
+        case NFC_TECHNOLOGY_B:
+            tech = 0x01;
+            break;
+        case NFC_TECHNOLOGY_F:
+            tech = 0x02;
+            break;
+        default:
+            return 0;
+        }
+        return nci_adapter_add_listen_route(self, ROUTE_TECHNOLOGY,
+            &tech, 1, nfcee, power);
+    }
+    return 0;
+}
+
+guint
+nci_adapter_add_protocol_route(
+    NciAdapter* self,
+    NCI_PROTOCOL protocol,
+    guint8 nfcee,
+    guint8 power)
+{
+    if (G_LIKELY(self)) {
+        const guint8 value = protocol;
+
+        return nci_adapter_add_listen_route(self, ROUTE_PROTOCOL,
+            &value, 1, nfcee, power);
+    }
+    return 0;
+}
+
+guint
+nci_adapter_add_aid_route(
+    NciAdapter* self,
+    const GUtilData* aid,
+    guint8 nfcee,
+    guint8 power)
+{
+    if (G_LIKELY(self) && G_LIKELY(aid) && aid->size > 0 &&
+        aid->size <= ROUTE_MAX_AID_LEN) {
+        return nci_adapter_add_listen_route(self, ROUTE_AID,
+            aid->bytes, aid->size, nfcee, power);
+    }
+    return 0;
+}
+
+void
+nci_adapter_remove_listen_route(
+    NciAdapter* self,
+    guint id)
+{
+    if (G_LIKELY(self) && G_LIKELY(id)) {
+        NciAdapterPriv* priv = self->priv;
+        GPtrArray* routes = priv->listen_routes;
+        guint i;
+
+        for (i = 0; routes && i < routes->len; i++) {
+            const NciAdapterListenRoute* route = routes->pdata[i];
+
+            if (route->id == id) {
+                g_ptr_array_remove_index(routes, i);
+                priv->listen_routes_dirty = TRUE;
+                nci_adapter_state_check(self);
+                break;
+            }
+        }
+    }
+}
+
+void
+nci_adapter_listen_mode_routing_done(
+    NciAdapter* self,
+    gboolean ok)
+{
+    if (G_LIKELY(self)) {
+        NciAdapterPriv* priv = self->priv;
+
+        if (priv->listen_routes_timer) {
+            g_source_remove(priv->listen_routes_timer);
+            priv->listen_routes_timer = 0;
+            if (ok) {
+                GDEBUG("Listen mode routing updated");
+            } else {
+                GWARN("Failed to update listen mode routing");
+            }
+            nci_adapter_state_check(self);
+            nci_adapter_mode_check(self);
+        }
+    }
+}
+
+guint
+nci_adapter_conn_create(
+    NciAdapter* self,
+    guint8 dest_type,
+    const GUtilData* dest_params,
+    NciAdapterConnFunc state,
+    NciAdapterConnDataFunc data,
+    void* user_data)
+{
+    if (G_LIKELY(self) && self->nci) {
+        NciAdapterClass* klass = NCI_ADAPTER_GET_CLASS(self);
+        NciAdapterPriv* priv = self->priv;
+        guint id = ++priv->last_conn_id;
+        NciConn* conn;
+
+        if (!id) {
+            id = ++priv->last_conn_id;
+        }
+        conn = nci_conn_new(self, id, state, data, user_data);
+        if (!priv->conns) {
+            priv->conns = g_ptr_array_new();
+        }
+        g_ptr_array_add(priv->conns, conn);
+        if (klass->conn_create(self, id, dest_type, dest_params)) {
+            return id;
+        }
+        g_ptr_array_remove(priv->conns, conn);
+        nci_conn_free(conn);
+    }
+    return 0;
+}
+
+gboolean
+nci_adapter_conn_send(
+    NciAdapter* self,
+    guint conn_id,
+    GBytes* data,
+    NciAdapterConnSendFunc done,
+    void* user_data)
+{
+    if (G_LIKELY(self) && G_LIKELY(data)) {
+        NciConn* conn = nci_adapter_find_conn(self->priv, conn_id, NULL);
+
+        if (conn) {
+            nci_conn_send(conn, data, done, user_data);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+void
+nci_adapter_conn_close(
+    NciAdapter* self,
+    guint conn_id)
+{
+    if (G_LIKELY(self)) {
+        NciAdapterPriv* priv = self->priv;
+        guint i;
+        NciConn* conn = nci_adapter_find_conn(priv, conn_id, &i);
+
+        if (conn) {
+            const int cid = nci_conn_cid(conn);
+
+            if (cid >= 0) {
+                NCI_ADAPTER_GET_CLASS(self)->conn_close(self, cid);
+            }
+            g_ptr_array_remove_index(priv->conns, i);
+            nci_conn_free(conn);
+        }
+    }
+}
+
+void
+nci_adapter_conn_created(
+    NciAdapter* self,
+    guint conn_id,
+    gboolean ok,
+    guint8 cid,
+    guint max_payload)
+{
+    if (G_LIKELY(self)) {
+        NciAdapterPriv* priv = self->priv;
+        guint i;
+        NciConn* conn = nci_adapter_find_conn(priv, conn_id, &i);
+
+        if (conn) {
+            if (ok) {
+                nci_conn_created(conn, TRUE, cid, max_payload);
+            } else {
+                /* The id becomes invalid, the callback can't close it */
+                g_ptr_array_remove_index(priv->conns, i);
+                nci_conn_created(conn, FALSE, cid, max_payload);
+                nci_conn_free(conn);
+            }
+        } else if (ok) {
+            /* Closed before it got created */
+            NCI_ADAPTER_GET_CLASS(self)->conn_close(self, cid);
+        }
+    }
+}
+
+void
+nci_adapter_conn_closed(
+    NciAdapter* self,
+    guint8 cid)
+{
+    if (G_LIKELY(self)) {
+        NciAdapterPriv* priv = self->priv;
+        guint i;
+        NciConn* conn = nci_adapter_find_cid(priv, cid, &i);
+
+        if (conn) {
+            g_ptr_array_remove_index(priv->conns, i);
+            nci_conn_closed(conn);
+            nci_conn_free(conn);
+        }
+    }
+}
+
+gboolean
+nci_adapter_set_uid_filter(
+    NciAdapter* self,
+    NCI_ADAPTER_UID_FILTER type,
+    const char* path)
+{
+    if (G_LIKELY(self)) {
+        NciAdapterPriv* priv = self->priv;
+        NciUidFilter* filter = NULL;
+
+        if (type != NCI_ADAPTER_UID_FILTER_NONE) {
+            if (!path) {
+                return FALSE;
+            }
+            filter = nci_uid_filter_new_from_file(path);
+            if (!filter) {
+                /* Keep the old one */
+                return FALSE;
+            }
+        }
+        nci_uid_filter_free(priv->uid_filter);
+        priv->uid_filter = filter;
+        priv->uid_filter_type = filter ? type : NCI_ADAPTER_UID_FILTER_NONE;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+guint
+nci_adapter_t2_write(
+    NciAdapter* self,
+    guint page,
+    const GUtilData* data,
+    const GUtilData* prev,
+    NciAdapterT2WriteFunc done,
+    void* user_data)
+{
+    if (G_LIKELY(self) && data && (!prev || prev->size == data->size)) {
+        NciAdapterPriv* priv = self->priv;
+        NciTargetT2* t2 = nci_target_t2(self->target);
+
+        if (t2 && !priv->t2_write) {
+            NciAdapterT2Write* write = g_slice_new0(NciAdapterT2Write);
+            guint id;
+
+            write->done = done;
+            write->user_data = user_data;
+            priv->t2_write = write;
+            id = nci_target_t2_write(t2, page, data->bytes,
+                prev ? prev->bytes : NULL, data->size,
+                nci_adapter_t2_write_done, NULL, self);
+            if (id) {
+                write->id = id;
+                return id;
+            }
+            priv->t2_write = NULL;
+            g_slice_free(NciAdapterT2Write, write);
+        }
+    }
+    return 0;
+}
+
+void
+nci_adapter_t2_cancel_write(
+    NciAdapter* self,
+    guint id)
+{
+    if (G_LIKELY(self) && id) {
+        NciAdapterPriv* priv = self->priv;
+        NciAdapterT2Write* write = priv->t2_write;
+
+        if (write && write->id == id) {
+            priv->t2_write = NULL;
+            nci_target_t2_cancel_write(nci_target_t2(self->target), id);
+            g_slice_free(NciAdapterT2Write, write);
+        }
+    }
+}
+
+gboolean
+nci_adapter_iso_dep_nak_presence_check(
+    NciAdapter* self,
+    NfcTarget* target)
+{
+    if (self && self->target == target && target) {
+        NciAdapterClass* klass = NCI_ADAPTER_GET_CLASS(self);
+
+        return klass->iso_dep_nak_presence_check(self);
+    }
+    return FALSE;
+}
+
+gboolean
+nci_adapter_reactivate(
+    NciAdapter* self,
+    NfcTarget* target)
+{
+    if (self && self->target == target && target) {
+        NciAdapterPriv* priv = self->priv;
+        NciCore* nci = self->nci;
+
+        if (priv->active_intf && !priv->reactivating && nci &&
+            ((nci->current_state == NCI_RFST_POLL_ACTIVE &&
+              nci->next_state == NCI_RFST_POLL_ACTIVE) ||
+             (nci->current_state == NCI_RFST_LISTEN_ACTIVE &&
+              nci->next_state == NCI_RFST_LISTEN_ACTIVE))) {
+            const NciAdapterIntfInfo* intf = priv->active_intf;
+            NciAdapterClass* klass = NCI_ADAPTER_GET_CLASS(self);
+
+            priv->reactivating = TRUE;
+            priv->reactivate_start = g_get_monotonic_time();
+            priv->reactivate_timer = g_timeout_add(REACTIVATE_TIMEOUT_MS,
+                nci_adapter_reactivate_timeout, self);
+            if (priv->presence_check_timer) {
+                /* Stop presence checks for the time being */
+                g_source_remove(priv->presence_check_timer);
+                priv->presence_check_timer = 0;
+            }
+            if (nci->current_state == NCI_RFST_POLL_ACTIVE &&
+                klass->reactivate_sleep_select(self, intf->discovery_id,
+                    intf->protocol, intf->rf_intf)) {
+                /* The target is known to be there, just select it again */
+                GDEBUG("Reactivating with sleep/select");
+                priv->reactivating_fast = TRUE;
+            } else {
+                /* Switch to discovery and expect the same target */
+                priv->reactivating_fast = FALSE;
+                nci_core_set_state(nci, NCI_RFST_DISCOVERY);
+            }
+            return TRUE;
+        }
+    }
+    GWARN("Can't reactivate the tag in this state");
+    return FALSE;
+}
+
+void
+nci_adapter_deactivate_target(
+    NciAdapter* self,
+    NfcTarget* target)
+{
+    if (self && self->target == target && target) {
+        nci_adapter_drop_target(self);
+        if (self->parent.powered) {
+            nci_core_set_state(self->nci, NCI_RFST_DISCOVERY);
+        }
+    }
+}
+
+void
+nci_adapter_target_transmit_error(
+    NciAdapter* self,
+    NfcTarget* target)
+{
+    if (self && self->target == target && target) {
+        NciAdapterPriv* priv = self->priv;
+
+        /* Something is wrong, check the target more often for a while */
+        if (priv->presence_check_count) {
+            priv->presence_check_count = 0;
+            if (priv->presence_check_timer &&
+                priv->presence_check_period > PRESENCE_CHECK_PERIOD_MS) {
+                GDEBUG("Tightening presence checks");
+                nci_adapter_presence_check_schedule(self);
+            }
+        }
+    }
+}
+
+const NciFingerprint*
+nci_adapter_target_fingerprint(
+    NciAdapter* self)
+{
+    if (G_LIKELY(self)) {
+        NciAdapterPriv* priv = self->priv;
+
+        return priv->active_intf ? &priv->active_intf->fingerprint : NULL;
+    }
+    return NULL;
+}
+
+gboolean
+nci_adapter_t2_no_version(
+    NciAdapter* self)
+{
+    const NciFingerprint* fp = nci_adapter_target_fingerprint(self);
+
+    return fp && self->priv->t2_no_version &&
+        g_hash_table_contains(self->priv->t2_no_version, fp);
+}
+
+/* Remembers that the current T2 target has NACKed GET_VERSION */
+void
+nci_adapter_t2_set_no_version(
+    NciAdapter* self)
+{
+    const NciFingerprint* fp = nci_adapter_target_fingerprint(self);
+
+    if (fp) {
+        NciAdapterPriv* priv = self->priv;
+        NciFingerprint* key = g_new(NciFingerprint, 1);
+
+        if (!priv->t2_no_version) {
+            priv->t2_no_version = g_hash_table_new_full(nci_fingerprint_hash,
+                nci_fingerprint_equal, g_free, NULL);
+        } else if (g_hash_table_size(priv->t2_no_version) >=
+            T2_NO_VERSION_CACHE_SIZE) {
+            /* Don't bother with LRU, it's just an optimization */
+            g_hash_table_remove_all(priv->t2_no_version);
+        }
+        memcpy(key, fp, sizeof(*key));
+        g_hash_table_add(priv->t2_no_version, key);
+    }
+}
+
+gboolean
+nci_adapter_apdu_handler_set(
+    NciAdapter* self)
+{
+    if (self) {
+        NciAdapterPriv* priv = self->priv;
+
+        return priv->apdu_handler || nci_aid_table_count(priv->aid_table);
+    }
+    return FALSE;
+}
+
+gboolean
+nci_adapter_handle_apdu(
+    NciAdapter* self,
+    NfcInitiator* initiator,
+    const void* apdu,
+    guint len)
+{
+    if (self) {
+        NciAdapterPriv* priv = self->priv;
+        const guint8* bytes = apdu;
+
+        /* SELECT by DF name: CLA INS(A4) P1(04) P2 Lc AID */
+        if (priv->aid_table && len >= 5 && !(bytes[0] & 0x80) &&
+            bytes[1] == 0xa4 && bytes[2] == 0x04 && 5 + bytes[4] <= len) {
+            priv->aid_route = nci_aid_table_lookup(priv->aid_table,
+                bytes + 5, bytes[4]);
+            if (!priv->aid_route && !priv->apdu_handler) {
+                static const guint8 not_found[] = { 0x6a, 0x82 };
+
+                return nci_adapter_respond_apdu(self, initiator,
+                    not_found, sizeof(not_found));
+            }
+        }
+        if (priv->aid_route) {
+            NciAdapterAidRoute* route = priv->aid_route;
+
+            return route->handler(self, initiator, apdu, len,
+                route->user_data);
+        } else if (priv->apdu_handler) {
+            return priv->apdu_handler(self, initiator, apdu, len,
+                priv->apdu_handler_data);
+        }
+    }
+    return FALSE;
+}
+
+guint
+nci_adapter_listen_fwt(
+    NciAdapter* self,
+    NCI_MODE mode)
+{
+    NciAdapterClass* klass = NCI_ADAPTER_GET_CLASS(self);
+    const guint fwi = klass->listen_fwi(self, mode);
+
+    /* Don't guess, the deadline is only tracked if FWI is known */
+    if (fwi > LISTEN_FWI_MAX) {
+        return 0;
+    }
+
+    /* FWT = (256 x 16 / fc) x 2^FWI, fc = 13.56 MHz */
+    return (guint)(((guint64)4096 << fwi) * 1000000 / 13560000);
+}
+
+void
+nci_adapter_apdu_answered(
+    NciAdapter* self,
+    guint latency_us,
+    guint fwt_us)
+{
+    if (self) {
+        NciAdapterPriv* priv = self->priv;
+        NciAdapterApduStats* stats = priv->aid_route ?
+            &priv->aid_route->stats : &priv->apdu_stats;
+
+        stats->count++;
+        if (latency_us > fwt_us) {
+            stats->late++;
+            GDEBUG("R-APDU took %u us, FWT %u us", latency_us, fwt_us);
+        } else if (latency_us > fwt_us - fwt_us / 4) {
+            stats->near_misses++;
+        }
+    }
+}
+
+gboolean
+nci_adapter_has_conn(
+    NciAdapter* self,
+    guint8 cid)
+{
+    return self && nci_adapter_find_cid(self->priv, cid, NULL);
+}
+
+NciT3tStore*
+nci_adapter_t3t_store(
+    NciAdapter* self)
+{
+    if (self) {
+        NciAdapterPriv* priv = self->priv;
+
+        if (nci_t3t_store_count(priv->t3t_store)) {
+            return priv->t3t_store;
+        }
+    }
+    return NULL;
+}
+
+void
+nci_adapter_deactivate_initiator(
+    NciAdapter* self,
+    NfcInitiator* initiator)
+{
+    if (self && initiator) {
+        NciAdapterPriv* priv = self->priv;
+
+        if (priv->initiator == initiator) {
+            nci_adapter_drop_initiator(priv);
+            if (self->parent.powered) {
+                nci_core_set_state(self->nci, NCI_RFST_DISCOVERY);
+            }
+        }
+    }
+}
+
+/*==========================================================================*
+ * Methods
+ *==========================================================================*/
 
 static
 gboolean
@@ -1054,6 +2579,10 @@ nci_adapter_submit_mode_request(
 
     priv->desired_mode = mode;
     priv->mode_change_pending = TRUE;
+    if (op_mode == NFC_OP_MODE_NONE) {
+        /* Discovery is being stopped anyway */
+        nci_adapter_discovery_hold_reset(priv);
+    }
     nci_core_set_op_mode(self->nci, op_mode);
     if (op_mode != NFC_OP_MODE_NONE && adapter->powered) {
         nci_core_set_state(self->nci, NCI_RFST_DISCOVERY);
@@ -1074,6 +2603,90 @@ nci_adapter_cancel_mode_request(
     nci_adapter_schedule_mode_check(self);
 }
 
+static
+guint
+nci_adapter_presence_check_period(
+    NciAdapter* self,
+    NCI_PROTOCOL protocol,
+    guint count)
+{
+    const guint max = (protocol == NCI_PROTOCOL_ISO_DEP) ?
+        PRESENCE_CHECK_MAX_PERIOD_ISO_DEP_MS :
+        PRESENCE_CHECK_MAX_PERIOD_MS;
+    guint period = PRESENCE_CHECK_PERIOD_MS;
+
+    /* Stay fast right after activation, then back off exponentially */
+    if (count > PRESENCE_CHECK_FAST_COUNT) {
+        guint n = count - PRESENCE_CHECK_FAST_COUNT;
+
+        while (n-- > 0 && period < max) {
+            period *= 2;
+        }
+    }
+    return MIN(period, max);
+}
+
+static
+gboolean
+nci_adapter_conn_create_default(
+    NciAdapter* self,
+    guint conn_id,
+    guint8 dest_type,
+    const GUtilData* dest_params)
+{
+    /* Requires help from the derived class */
+    return FALSE;
+}
+
+static
+void
+nci_adapter_conn_close_default(
+    NciAdapter* self,
+    guint8 cid)
+{
+}
+
+static
+guint
+nci_adapter_listen_fwi_default(
+    NciAdapter* self,
+    NCI_MODE mode)
+{
+    /* Only the derived class knows how NFCC has been configured */
+    return LISTEN_FWI_UNKNOWN;
+}
+
+static
+gboolean
+nci_adapter_reactivate_sleep_select_default(
+    NciAdapter* self,
+    guint8 discovery_id,
+    NCI_PROTOCOL protocol,
+    NCI_RF_INTERFACE rf_intf)
+{
+    /* Requires help from the derived class */
+    return FALSE;
+}
+
+static
+guint
+nci_adapter_target_grace_period_default(
+    NciAdapter* self,
+    NCI_PROTOCOL protocol)
+{
+    /* Disabled by default */
+    return 0;
+}
+
+static
+gboolean
+nci_adapter_iso_dep_nak_presence_check_default(
+    NciAdapter* self)
+{
+    /* Requires help from the derived class */
+    return FALSE;
+}
+
 static
 void
 nci_adapter_current_state_changed(
@@ -1146,7 +2759,60 @@ void
 nci_adapter_finalize(
     GObject* object)
 {
-    nci_adapter_finalize_core(THIS(object));
+    NciAdapter* self = THIS(object);
+    NciAdapterPriv* priv = self->priv;
+    int i;
+
+    if (priv->intf_count) {
+        GDEBUG("Parameters converted %u time(s) for %u activation(s)",
+            priv->param_count, priv->intf_count);
+    }
+    if (priv->uid_filter_rejected) {
+        GDEBUG("%u activation(s) rejected by UID filter",
+            priv->uid_filter_rejected);
+    }
+    nci_adapter_apdu_stats_dump(&priv->apdu_stats, "APDU handler", 0);
+    nci_aid_table_free(priv->aid_table);
+    nci_t4_ndef_free(priv->t4_ndef);
+    nci_t3t_store_free(priv->t3t_store);
+    if (priv->listen_routes) {
+        g_ptr_array_free(priv->listen_routes, TRUE);
+    }
+    if (priv->nfcee_activations) {
+        GDEBUG("%u activation(s) routed to NFCEE", priv->nfcee_activations);
+    }
+    if (priv->t2_no_version) {
+        g_hash_table_destroy(priv->t2_no_version);
+    }
+    if (priv->unsupported) {
+        g_hash_table_destroy(priv->unsupported);
+    }
+    nci_uid_filter_free(priv->uid_filter);
+    if (priv->discovery_hold_id) {
+        g_source_remove(priv->discovery_hold_id);
+    }
+    if (priv->listen_routes_timer) {
+        g_source_remove(priv->listen_routes_timer);
+    }
+    if (priv->unsupported_count) {
+        GDEBUG("%u unsupported activation(s), discovery held %u time(s) "
+            "for %u ms in total", priv->unsupported_count,
+            priv->discovery_hold_count, (guint)priv->discovery_hold_ms);
+    }
+    for (i = 0; i < REACTIVATE_PATH_COUNT; i++) {
+        const guint n = priv->reactivate_count[i];
+
+        if (n) {
+            GDEBUG("%u reactivation(s) via %s, %u ms on average", n,
+                reactivate_path_name[i], (guint)
+                (priv->reactivate_time[i] / n / 1000));
+        }
+    }
+    while (priv->intf_pool_count) {
+        g_slice_free(NciAdapterIntfInfo,
+            priv->intf_pool[--priv->intf_pool_count]);
+    }
+    nci_adapter_finalize_core(self);
     G_OBJECT_CLASS(PARENT_CLASS)->finalize(object);
 }
 
@@ -1161,6 +2827,15 @@ nci_adapter_class_init(
     g_type_class_add_private(klass, sizeof(NciAdapterPriv));
     klass->current_state_changed = nci_adapter_current_state_changed;
     klass->next_state_changed = nci_adapter_next_state_changed;
+    klass->presence_check_period = nci_adapter_presence_check_period;
+    klass->iso_dep_nak_presence_check =
+        nci_adapter_iso_dep_nak_presence_check_default;
+    klass->target_grace_period = nci_adapter_target_grace_period_default;
+    klass->reactivate_sleep_select =
+        nci_adapter_reactivate_sleep_select_default;
+    klass->listen_fwi = nci_adapter_listen_fwi_default;
+    klass->conn_create = nci_adapter_conn_create_default;
+    klass->conn_close = nci_adapter_conn_close_default;
     adapter_class->submit_mode_request = nci_adapter_submit_mode_request;
     adapter_class->cancel_mode_request = nci_adapter_cancel_mode_request;
     object_class->dispose = nci_adapter_dispose;
@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "nci_plugin_p.h"
+#include "nci_plugin_log.h"
+
+#define MAX_AID_LEN (16)
+#define NO_ENTRY (0)
+
+/*
+ * Trie over AID bytes. Nodes live in a flat array and refer to each
+ * other by index, siblings are sorted by byte value. Each node caches
+ * the best entry (by priority) that matches there, so that the lookup
+ * is a single walk down the trie and never allocates anything. The trie
+ * is rebuilt from scratch whenever an entry is added or removed, which
+ * is rare and cheap for a few dozens of AIDs.
+ */
+typedef struct nci_aid_node {
+    guint child;    /* First child, the root (0) is never anyone's child */
+    guint next;     /* Next sibling */
+    guint exact;    /* Best exact match, entry index + 1 */
+    guint prefix;   /* Best prefix match */
+    guint partial;  /* Best entry further down the trie */
+    guint8 byte;
+} NciAidNode;
+
+typedef struct nci_aid_entry {
+    guint id;
+    int priority;
+    gboolean prefix;
+    gpointer data;
+    guint8 len;
+    guint8 aid[MAX_AID_LEN];
+} NciAidEntry;
+
+struct nci_aid_table {
+    GPtrArray* entries;
+    GDestroyNotify destroy;
+    NciAidNode* nodes;
+    guint num_nodes;
+    guint max_nodes;
+    guint last_id;
+};
+
+static
+void
+nci_aid_table_entry_free(
+    NciAidTable* self,
+    NciAidEntry* entry)
+{
+    if (self->destroy) {
+        self->destroy(entry->data);
+    }
+    g_free(entry);
+}
+
+static
+gboolean
+nci_aid_table_better(
+    const NciAidTable* self,
+    guint e1,
+    guint e2)
+{
+    if (e1 == NO_ENTRY) {
+        return FALSE;
+    } else if (e2 == NO_ENTRY) {
+        return TRUE;
+    } else {
+        const NciAidEntry* a = self->entries->pdata[e1 - 1];
+        const NciAidEntry* b = self->entries->pdata[e2 - 1];
+
+        /* Priority first, then the more specific match, then the older */
+        if (a->priority != b->priority) {
+            return a->priority > b->priority;
+        } else if (a->len != b->len) {
+            return a->len > b->len;
+        } else if (a->prefix != b->prefix) {
+            return !a->prefix;
+        } else {
+            return a->id < b->id;
+        }
+    }
+}
+
+static
+void
+nci_aid_table_pick(
+    const NciAidTable* self,
+    guint* best,
+    guint e)
+{
+    if (nci_aid_table_better(self, e, *best)) {
+        *best = e;
+    }
+}
+
+static
+guint
+nci_aid_table_child(
+    const NciAidTable* self,
+    guint node,
+    guint8 byte)
+{
+    guint i = self->nodes[node].child;
+
+    while (i && self->nodes[i].byte < byte) {
+        i = self->nodes[i].next;
+    }
+    return (i && self->nodes[i].byte == byte) ? i : 0;
+}
+
+static
+guint
+nci_aid_table_add_child(
+    NciAidTable* self,
+    guint parent,
+    guint8 byte)
+{
+    guint i = self->num_nodes++;
+    guint* link;
+    NciAidNode* node;
+
+    if (i == self->max_nodes) {
+        self->max_nodes = MAX(2 * self->max_nodes, 16);
+        self->nodes = g_renew(NciAidNode, self->nodes, self->max_nodes);
+    }
+    node = self->nodes + i;
+    memset(node, 0, sizeof(*node));
+    node->byte = byte;
+
+    /* Keep the siblings sorted */
+    link = &self->nodes[parent].child;
+    while (*link && self->nodes[*link].byte < byte) {
+        link = &self->nodes[*link].next;
+    }
+    node->next = *link;
+    *link = i;
+    return i;
+}
+
+static
+void
+nci_aid_table_rebuild(
+    NciAidTable* self)
+{
+    guint k;
+
+    /* Root node is always there */
+    if (!self->max_nodes) {
+        self->max_nodes = 16;
+        self->nodes = g_new(NciAidNode, self->max_nodes);
+    }
+    self->num_nodes = 1;
+    memset(self->nodes, 0, sizeof(self->nodes[0]));
+
+    for (k = 0; k < self->entries->len; k++) {
+        const NciAidEntry* entry = self->entries->pdata[k];
+        const guint e = k + 1;
+        guint i, node = 0;
+
+        for (i = 0; i < entry->len; i++) {
+            guint child = nci_aid_table_child(self, node, entry->aid[i]);
+
+            /* Partial selection of anything below this node */
+            nci_aid_table_pick(self, &self->nodes[node].partial, e);
+            node = child ? child : nci_aid_table_add_child(self, node,
+                entry->aid[i]);
+        }
+        nci_aid_table_pick(self, entry->prefix ? &self->nodes[node].prefix :
+            &self->nodes[node].exact, e);
+    }
+}
+
+/*==========================================================================*
+ * Internal interface
+ *==========================================================================*/
+
+NciAidTable*
+nci_aid_table_new(
+    GDestroyNotify destroy)
+{
+    NciAidTable* self = g_new0(NciAidTable, 1);
+
+    self->entries = g_ptr_array_new();
+    self->destroy = destroy;
+    nci_aid_table_rebuild(self);
+    return self;
+}
+
+void
+nci_aid_table_free(
+    NciAidTable* self)
+{
+    if (self) {
+        guint i;
+
+        for (i = 0; i < self->entries->len; i++) {
+            nci_aid_table_entry_free(self, self->entries->pdata[i]);
+        }
+        g_ptr_array_free(self->entries, TRUE);
+        g_free(self->nodes);
+        g_free(self);
+    }
+}
+
+guint
+nci_aid_table_count(
+    const NciAidTable* self)
+{
+    return self ? self->entries->len : 0;
+}
+
+guint
+nci_aid_table_add(
+    NciAidTable* self,
+    const guint8* aid,
+    guint len,
+    gboolean prefix,
+    int priority,
+    gpointer data)
+{
+    if (G_LIKELY(self) && len > 0 && len <= MAX_AID_LEN) {
+        NciAidEntry* entry = g_new0(NciAidEntry, 1);
+
+        entry->id = ++self->last_id;
+        if (!entry->id) {
+            entry->id = ++self->last_id;
+        }
+        entry->priority = priority;
+        entry->prefix = prefix;
+        entry->data = data;
+        entry->len = len;
+        memcpy(entry->aid, aid, len);
+        g_ptr_array_add(self->entries, entry);
+        nci_aid_table_rebuild(self);
+        return entry->id;
+    }
+    return 0;
+}
+
+gboolean
+nci_aid_table_remove(
+    NciAidTable* self,
+    guint id)
+{
+    if (G_LIKELY(self) && id) {
+        guint i;
+
+        for (i = 0; i < self->entries->len; i++) {
+            NciAidEntry* entry = self->entries->pdata[i];
+
+            if (entry->id == id) {
+                /* Keep the order, it's the tie breaker */
+                g_ptr_array_remove_index(self->entries, i);
+                nci_aid_table_rebuild(self);
+                nci_aid_table_entry_free(self, entry);
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Finds the entry for the AID selected by name. Exact and prefix
+ * matches compete with each other on priority. If nothing matches,
+ * the selected AID is treated as the beginning of a longer one
+ * (ISO/IEC 7816-4 partial DF name selection).
+ */
+gpointer
+nci_aid_table_lookup(
+    const NciAidTable* self,
+    const guint8* aid,
+    guint len)
+{
+    if (G_LIKELY(self) && len > 0) {
+        const NciAidNode* nodes = self->nodes;
+        guint i, node = 0, best = NO_ENTRY;
+
+        for (i = 0; i < len; i++) {
+            if (!(node = nci_aid_table_child(self, node, aid[i]))) {
+                break;
+            }
+            nci_aid_table_pick(self, &best, nodes[node].prefix);
+        }
+        if (node) {
+            nci_aid_table_pick(self, &best, nodes[node].exact);
+            if (best == NO_ENTRY) {
+                best = nodes[node].partial;
+            }
+        }
+        if (best != NO_ENTRY) {
+            const NciAidEntry* entry = self->entries->pdata[best - 1];
+
+            return entry->data;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
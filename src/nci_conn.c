@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "nci_plugin_p.h"
+#include "nci_plugin_log.h"
+#include "nci_adapter_impl.h"
+
+#include <nci_core.h>
+
+/*
+ * Dynamic logical connection (e.g. to NFCEE). Each connection has its
+ * own send queue and only one message at a time is passed to NciCore,
+ * which takes care of segmentation and flow control. That way a busy
+ * connection doesn't fill NciCore's queue with its messages.
+ */
+
+typedef struct nci_conn_send_req {
+    GBytes* bytes;
+    NciAdapterConnSendFunc done;
+    void* user_data;
+} NciConnSendReq;
+
+struct nci_conn {
+    gint refcount; /* Callbacks may free the connection */
+    NciAdapter* adapter;
+    guint id;
+    guint8 cid;
+    gboolean open;
+    guint max_payload;
+    GQueue queue;
+    NciConnSendReq* current;
+    guint send_id;
+    NciAdapterConnFunc state_fn;
+    NciAdapterConnDataFunc data_fn;
+    void* user_data;
+};
+
+static
+void
+nci_conn_send_req_free(
+    NciConnSendReq* req)
+{
+    g_bytes_unref(req->bytes);
+    g_slice_free(NciConnSendReq, req);
+}
+
+static
+NciConn*
+nci_conn_ref(
+    NciConn* self)
+{
+    self->refcount++;
+    return self;
+}
+
+static
+void
+nci_conn_unref(
+    NciConn* self)
+{
+    if (!--self->refcount) {
+        g_slice_free(NciConn, self);
+    }
+}
+
+static
+void
+nci_conn_send_next(
+    NciConn* self);
+
+static
+void
+nci_conn_sent(
+    NciCore* nci,
+    gboolean success,
+    void* user_data)
+{
+    NciConn* self = nci_conn_ref(user_data);
+    NciConnSendReq* req = self->current;
+
+    self->send_id = 0;
+    self->current = NULL;
+    if (req->done) {
+        req->done(self->adapter, self->id, success, req->user_data);
+    }
+    nci_conn_send_req_free(req);
+    nci_conn_send_next(self);
+    nci_conn_unref(self);
+}
+
+static
+void
+nci_conn_send_next(
+    NciConn* self)
+{
+    nci_conn_ref(self);
+    while (self->open && !self->current && self->queue.length) {
+        NciConnSendReq* req = g_queue_pop_head(&self->queue);
+
+        self->current = req;
+        self->send_id = nci_core_send_data_msg(self->adapter->nci,
+            self->cid, req->bytes, nci_conn_sent, NULL, self);
+        if (!self->send_id) {
+            self->current = NULL;
+            GWARN("Failed to send data to connection 0x%02x", self->cid);
+            if (req->done) {
+                req->done(self->adapter, self->id, FALSE, req->user_data);
+            }
+            nci_conn_send_req_free(req);
+        }
+    }
+    nci_conn_unref(self);
+}
+
+/*==========================================================================*
+ * Internal interface
+ *==========================================================================*/
+
+NciConn*
+nci_conn_new(
+    NciAdapter* adapter,
+    guint id,
+    NciAdapterConnFunc state_fn,
+    NciAdapterConnDataFunc data_fn,
+    void* user_data)
+{
+    NciConn* self = g_slice_new0(NciConn);
+
+    self->refcount = 1;
+    self->adapter = adapter;
+    self->id = id;
+    self->state_fn = state_fn;
+    self->data_fn = data_fn;
+    self->user_data = user_data;
+    g_queue_init(&self->queue);
+    return self;
+}
+
+/* Drops pending data without invoking any callbacks */
+void
+nci_conn_free(
+    NciConn* self)
+{
+    if (self) {
+        NciConnSendReq* req;
+
+        if (self->send_id) {
+            nci_core_cancel(self->adapter->nci, self->send_id);
+            self->send_id = 0;
+        }
+        if (self->current) {
+            nci_conn_send_req_free(self->current);
+            self->current = NULL;
+        }
+        while ((req = g_queue_pop_head(&self->queue)) != NULL) {
+            nci_conn_send_req_free(req);
+        }
+        self->open = FALSE;
+        self->state_fn = NULL;
+        self->data_fn = NULL;
+        nci_conn_unref(self);
+    }
+}
+
+guint
+nci_conn_id(
+    const NciConn* self)
+{
+    return self->id;
+}
+
+/* Returns -1 if the connection is not open */
+int
+nci_conn_cid(
+    const NciConn* self)
+{
+    return self->open ? self->cid : -1;
+}
+
+gboolean
+nci_conn_has_cid(
+    const NciConn* self,
+    guint8 cid)
+{
+    return self->open && self->cid == cid;
+}
+
+void
+nci_conn_created(
+    NciConn* self,
+    gboolean ok,
+    guint8 cid,
+    guint max_payload)
+{
+    nci_conn_ref(self);
+    if (ok && max_payload) {
+        GDEBUG("Connection 0x%02x created, max payload %u", cid,
+            max_payload);
+        self->open = TRUE;
+        self->cid = cid;
+        self->max_payload = max_payload;
+    }
+    if (self->state_fn) {
+        self->state_fn(self->adapter, self->id, self->open,
+            self->user_data);
+    }
+    nci_conn_send_next(self);
+    nci_conn_unref(self);
+}
+
+void
+nci_conn_closed(
+    NciConn* self)
+{
+    GDEBUG("Connection 0x%02x closed", self->cid);
+    self->open = FALSE;
+    if (self->state_fn) {
+        nci_conn_ref(self);
+        self->state_fn(self->adapter, self->id, FALSE, self->user_data);
+        nci_conn_unref(self);
+    }
+}
+
+void
+nci_conn_data(
+    NciConn* self,
+    const void* data,
+    guint len)
+{
+    if (self->data_fn) {
+        nci_conn_ref(self);
+        self->data_fn(self->adapter, self->id, data, len, self->user_data);
+        nci_conn_unref(self);
+    }
+}
+
+void
+nci_conn_send(
+    NciConn* self,
+    GBytes* bytes,
+    NciAdapterConnSendFunc done,
+    void* user_data)
+{
+    NciConnSendReq* req = g_slice_new(NciConnSendReq);
+
+    req->bytes = g_bytes_ref(bytes);
+    req->done = done;
+    req->user_data = user_data;
+    g_queue_push_tail(&self->queue, req);
+    nci_conn_send_next(self);
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
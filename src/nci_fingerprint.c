@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "nci_plugin_p.h"
+
+#include <nci_types.h>
+
+#define RANDOM_UID_SIZE (4)
+#define RANDOM_UID_START_BYTE (0x08)
+
+/* Stands in for the UID when it's not a part of the identity */
+#define NO_UID (0xff)
+
+typedef struct nci_fingerprint_builder {
+    NciFingerprint* fp;
+    guint hash;
+} NciFingerprintBuilder;
+
+static
+void
+nci_fingerprint_add(
+    NciFingerprintBuilder* b,
+    const void* data,
+    guint len)
+{
+    NciFingerprint* fp = b->fp;
+    const guint8* ptr = data;
+    guint i;
+
+    for (i = 0; i < len; i++) {
+        /* Same as g_str_hash */
+        b->hash = (b->hash << 5) + b->hash + ptr[i];
+        if (fp->size < NCI_FINGERPRINT_MAX_SIZE) {
+            fp->data[fp->size] = ptr[i];
+        }
+        fp->size++;
+    }
+}
+
+static
+void
+nci_fingerprint_add_byte(
+    NciFingerprintBuilder* b,
+    guint8 byte)
+{
+    nci_fingerprint_add(b, &byte, 1);
+}
+
+static
+void
+nci_fingerprint_add_data(
+    NciFingerprintBuilder* b,
+    const void* data,
+    guint len)
+{
+    /* Length prefix keeps variable-length fields unambiguous */
+    nci_fingerprint_add_byte(b, (guint8)len);
+    nci_fingerprint_add(b, data, len);
+}
+
+static
+void
+nci_fingerprint_add_poll_a(
+    NciFingerprintBuilder* b,
+    const NciModeParamPollA* pa,
+    gboolean uid)
+{
+    nci_fingerprint_add(b, pa->sens_res, sizeof(pa->sens_res));
+    nci_fingerprint_add_byte(b, pa->sel_res_len);
+    nci_fingerprint_add_byte(b, pa->sel_res);
+    if (uid) {
+        /*
+         * According to AN10927 Random UID RID should be handled
+         * separately - single sized (4 bytes) starting with 0x08.
+         * Other UIDs have to fully match.
+         */
+        if (pa->nfcid1_len == RANDOM_UID_SIZE &&
+            pa->nfcid1[0] == RANDOM_UID_START_BYTE) {
+            nci_fingerprint_add_byte(b, RANDOM_UID_START_BYTE);
+            nci_fingerprint_add_byte(b, NO_UID);
+        } else {
+            nci_fingerprint_add_data(b, pa->nfcid1, pa->nfcid1_len);
+        }
+    } else {
+        nci_fingerprint_add_byte(b, NO_UID);
+    }
+}
+
+static
+void
+nci_fingerprint_add_poll_b(
+    NciFingerprintBuilder* b,
+    const NciModeParamPollB* pb)
+{
+    guint8 fsc[4];
+
+    /* UID is excluded because it may change after losing the field */
+    fsc[0] = (guint8)(pb->fsc >> 24);
+    fsc[1] = (guint8)(pb->fsc >> 16);
+    fsc[2] = (guint8)(pb->fsc >> 8);
+    fsc[3] = (guint8)pb->fsc;
+    nci_fingerprint_add(b, fsc, sizeof(fsc));
+    nci_fingerprint_add(b, pb->app_data, sizeof(pb->app_data));
+    nci_fingerprint_add_data(b, pb->prot_info.bytes, pb->prot_info.size);
+}
+
+static
+gboolean
+nci_fingerprint_add_mode_param(
+    NciFingerprintBuilder* b,
+    const NciIntfActivationNtf* ntf)
+{
+    const NciModeParam* mp = ntf->mode_param;
+
+    if (mp) {
+        /* Which fields matter depends on type of tag */
+        switch (ntf->mode) {
+        case NCI_MODE_PASSIVE_POLL_A:
+            switch (ntf->rf_intf) {
+            case NCI_RF_INTERFACE_FRAME:
+                /* Type 2 Tag */
+                nci_fingerprint_add_poll_a(b, &mp->poll_a, TRUE);
+                return TRUE;
+            case NCI_RF_INTERFACE_ISO_DEP:
+                /* ISO-DEP Type 4A, UID may change after losing field */
+                nci_fingerprint_add_poll_a(b, &mp->poll_a, FALSE);
+                return TRUE;
+            case NCI_RF_INTERFACE_NFCEE_DIRECT:
+            case NCI_RF_INTERFACE_NFC_DEP:
+            case NCI_RF_INTERFACE_PROPRIETARY:
+                break;
+            }
+            break;
+        case NCI_MODE_PASSIVE_POLL_B:
+            switch (ntf->rf_intf) {
+            case NCI_RF_INTERFACE_ISO_DEP:
+                /* ISO-DEP Type 4B */
+                nci_fingerprint_add_poll_b(b, &mp->poll_b);
+                return TRUE;
+            case NCI_RF_INTERFACE_FRAME:
+            case NCI_RF_INTERFACE_NFCEE_DIRECT:
+            case NCI_RF_INTERFACE_NFC_DEP:
+            case NCI_RF_INTERFACE_PROPRIETARY:
+                break;
+            }
+            break;
+        case NCI_MODE_ACTIVE_POLL_A:
+        case NCI_MODE_PASSIVE_POLL_F:
+        case NCI_MODE_ACTIVE_POLL_F:
+        case NCI_MODE_PASSIVE_POLL_15693:
+        case NCI_MODE_PASSIVE_LISTEN_A:
+        case NCI_MODE_PASSIVE_LISTEN_B:
+        case NCI_MODE_PASSIVE_LISTEN_F:
+        case NCI_MODE_ACTIVE_LISTEN_A:
+        case NCI_MODE_ACTIVE_LISTEN_F:
+        case NCI_MODE_PASSIVE_LISTEN_15693:
+            break;
+        }
+    }
+    return FALSE;
+}
+
+/*==========================================================================*
+ * Internal interface
+ *==========================================================================*/
+
+/*
+ * Computes the identity of the activated target. Two activations have
+ * equal fingerprints if they (most likely) come from the same target,
+ * i.e. the fields which may change after losing the field (like random
+ * UIDs) are left out.
+ */
+void
+nci_fingerprint_init(
+    NciFingerprint* fp,
+    const NciIntfActivationNtf* ntf)
+{
+    NciFingerprintBuilder b;
+
+    memset(fp, 0, sizeof(*fp));
+    b.fp = fp;
+    b.hash = 5381;
+    nci_fingerprint_add_byte(&b, (guint8)ntf->rf_intf);
+    nci_fingerprint_add_byte(&b, (guint8)ntf->protocol);
+    nci_fingerprint_add_byte(&b, (guint8)ntf->mode);
+    if (!nci_fingerprint_add_mode_param(&b, ntf)) {
+        /* Full match is expected in other cases */
+        nci_fingerprint_add_data(&b, ntf->mode_param_bytes,
+            ntf->mode_param_len);
+    }
+    nci_fingerprint_add_data(&b, ntf->activation_param_bytes,
+        ntf->activation_param_len);
+    fp->hash = b.hash;
+}
+
+/* GHashFunc */
+guint
+nci_fingerprint_hash(
+    gconstpointer fp)
+{
+    return ((const NciFingerprint*)fp)->hash;
+}
+
+/*
+ * GEqualFunc. The data are compared exactly. A fingerprint which didn't
+ * fit (that shouldn't happen) is only equal to itself.
+ */
+gboolean
+nci_fingerprint_equal(
+    gconstpointer a,
+    gconstpointer b)
+{
+    const NciFingerprint* fp1 = a;
+    const NciFingerprint* fp2 = b;
+
+    return fp1 == fp2 || (fp1 && fp2 && fp1->hash == fp2->hash &&
+        fp1->size == fp2->size && fp1->size <= NCI_FINGERPRINT_MAX_SIZE &&
+        !memcmp(fp1->data, fp2->data, fp1->size));
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
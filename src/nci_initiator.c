@@ -54,8 +54,24 @@ typedef struct nci_initiator {
     NciAdapter* adapter;
     gulong event_id[EVENT_COUNT];
     guint response_in_progress;
+    gboolean card_emulation; /* ISO-DEP, APDUs are handled by the adapter */
+    gboolean apdu_response; /* Response isn't coming from NfcInitiator */
+    guint8 nfcid2[NCI_T3T_NFCID2_LEN]; /* Type 3 tag emulation */
+    gboolean apdu_pending; /* Waiting for R-APDU */
+    gboolean apdu_failed; /* R-APDU couldn't be sent */
+    GBytes* apdu_queued; /* R-APDU waiting for the previous one to go */
+    gint64 apdu_start; /* When the pending C-APDU has arrived */
+    guint fwt_us; /* ISO-DEP frame waiting time, zero if not tracked */
+    guint wtx_id;
+    guint wtx_count;
 } NciInitiator;
 
+/* Beyond that the reader is unlikely to be still waiting */
+#define CE_MAX_RESPONSE_MS (5000)
+
+/* SW1-SW2 meaning "no precise diagnosis" */
+static const guint8 nci_initiator_apdu_not_handled[] = { 0x6f, 0x00 };
+
 GType nci_initiator_get_type(void) G_GNUC_INTERNAL;
 #define PARENT_CLASS nci_initiator_parent_class
 #define THIS_TYPE (nci_initiator_get_type())
@@ -84,6 +100,22 @@ nci_initiator_cancel_response(
         }
         self->response_in_progress = 0;
     }
+    if (self->apdu_queued) {
+        g_bytes_unref(self->apdu_queued);
+        self->apdu_queued = NULL;
+    }
+}
+
+static
+void
+nci_initiator_apdu_done(
+    NciInitiator* self)
+{
+    self->apdu_pending = FALSE;
+    if (self->wtx_id) {
+        g_source_remove(self->wtx_id);
+        self->wtx_id = 0;
+    }
 }
 
 static
@@ -95,6 +127,10 @@ nci_initiator_drop_adapter(
         NciAdapter* adapter = self->adapter;
 
         nci_initiator_cancel_response(self);
+        nci_initiator_apdu_done(self);
+        if (self->wtx_count) {
+            GDEBUG("Waited %u extra FWT(s) for R-APDU", self->wtx_count);
+        }
         nci_core_remove_all_handlers(adapter->nci, self->event_id);
         g_object_remove_weak_pointer(G_OBJECT(adapter), (gpointer*)
             &self->adapter);
@@ -102,6 +138,60 @@ nci_initiator_drop_adapter(
     }
 }
 
+static
+void
+nci_initiator_respond_not_handled(
+    NciInitiator* self)
+{
+    /* Static data, nothing to copy */
+    GBytes* bytes = g_bytes_new_static(nci_initiator_apdu_not_handled,
+        sizeof(nci_initiator_apdu_not_handled));
+
+    nci_initiator_respond_apdu_bytes(&self->initiator, bytes);
+    g_bytes_unref(bytes);
+}
+
+static
+gboolean
+nci_initiator_wtx_timeout(
+    gpointer user_data)
+{
+    NciInitiator* self = THIS(user_data);
+    const guint elapsed_ms = (guint)((g_get_monotonic_time() -
+        self->apdu_start) / 1000);
+
+    /*
+     * NFCC keeps extending the waiting time with S(WTX) for as long as
+     * the response is not ready, but there's a limit to everything.
+     * Without FWT there's only one tick, at the very end.
+     */
+    if (!self->fwt_us ||
+        elapsed_ms + self->fwt_us / 1000 >= CE_MAX_RESPONSE_MS) {
+        self->wtx_id = 0;
+        GWARN("No R-APDU in %u ms, giving up", elapsed_ms);
+        nci_initiator_respond_not_handled(self);
+        return G_SOURCE_REMOVE;
+    }
+    self->wtx_count++;
+    return G_SOURCE_CONTINUE;
+}
+
+static
+void
+nci_initiator_apdu_start(
+    NciInitiator* self)
+{
+    nci_initiator_apdu_done(self);
+    self->apdu_pending = TRUE;
+    self->apdu_failed = FALSE;
+    self->apdu_start = g_get_monotonic_time();
+
+    /* The reader mustn't be left waiting forever, FWT or not */
+    self->wtx_id = g_timeout_add(self->fwt_us ?
+        MAX(self->fwt_us / 1000, 1) : CE_MAX_RESPONSE_MS,
+        nci_initiator_wtx_timeout, self);
+}
+
 static
 void
 nci_initiator_data_packet_handler(
@@ -112,12 +202,51 @@ nci_initiator_data_packet_handler(
     void* user_data)
 {
     if (cid == NCI_STATIC_RF_CONN_ID) {
-        nfc_initiator_transmit(NFC_INITIATOR(user_data), data, len);
-    } else {
+        NciInitiator* self = THIS(user_data);
+        NfcInitiator* initiator = &self->initiator;
+
+        if (initiator->protocol == NFC_PROTOCOL_T3_TAG) {
+            NciT3tStore* store = nci_adapter_t3t_store(self->adapter);
+
+            /* Blocks are right here, no need to bother anyone */
+            if (store) {
+                guint8* resp = g_malloc(NCI_T3T_MAX_RESPONSE);
+                const guint n = nci_t3t_store_process(store, self->nfcid2,
+                    data, len, resp);
+
+                if (n) {
+                    /* The response is built in place and sent as is */
+                    GBytes* bytes = g_bytes_new_take(resp, n);
+
+                    nci_initiator_apdu_start(self);
+                    nci_initiator_respond_apdu_bytes(initiator, bytes);
+                    g_bytes_unref(bytes);
+                } else {
+                    g_free(resp);
+                }
+            }
+        } else if (self->card_emulation) {
+            /* Shortcut, no need to go through NfcInitiator */
+            nci_initiator_apdu_start(self);
+            if (!nci_adapter_handle_apdu(self->adapter, initiator,
+                data, len) || self->apdu_failed) {
+                /* Don't leave the reader waiting for nothing */
+                nci_initiator_respond_not_handled(self);
+            }
+        } else {
+            nfc_initiator_transmit(initiator, data, len);
+        }
+    } else if (!nci_adapter_has_conn(THIS(user_data)->adapter, cid)) {
         GDEBUG("Unhandled data packet, cid=0x%02x %u byte(s)", cid, len);
     }
 }
 
+static
+gboolean
+nci_initiator_respond_bytes(
+    NciInitiator* self,
+    GBytes* bytes);
+
 static
 void
 nci_initiator_response_sent(
@@ -129,8 +258,47 @@ nci_initiator_response_sent(
 
     GASSERT(self->response_in_progress);
     self->response_in_progress = 0;
-    nfc_initiator_response_sent(&self->initiator, success ?
-        NFC_TRANSMIT_STATUS_OK : NFC_TRANSMIT_STATUS_ERROR);
+    if (self->apdu_response) {
+        self->apdu_response = FALSE;
+        if (!success) {
+            GDEBUG("Failed to send R-APDU");
+        }
+    } else {
+        nfc_initiator_response_sent(&self->initiator, success ?
+            NFC_TRANSMIT_STATUS_OK : NFC_TRANSMIT_STATUS_ERROR);
+    }
+    if (self->apdu_queued) {
+        GBytes* bytes = self->apdu_queued;
+
+        /* The next R-APDU has been waiting for this one */
+        self->apdu_queued = NULL;
+        self->apdu_response = TRUE;
+        if (!nci_initiator_respond_bytes(self, bytes)) {
+            GDEBUG("Failed to send R-APDU");
+            self->apdu_response = FALSE;
+        }
+        g_bytes_unref(bytes);
+    }
+}
+
+static
+gboolean
+nci_initiator_respond_bytes(
+    NciInitiator* self,
+    GBytes* bytes)
+{
+    NciAdapter* adapter = self->adapter;
+
+    /* NciCore holds a reference to the bytes until the send completes */
+    if (adapter) {
+        self->response_in_progress = nci_core_send_data_msg(adapter->nci,
+            NCI_STATIC_RF_CONN_ID, bytes, nci_initiator_response_sent,
+            NULL, self);
+        if (self->response_in_progress) {
+            return TRUE;
+        }
+    }
+    return FALSE;
 }
 
 /*==========================================================================*
@@ -174,7 +342,23 @@ nci_initiator_new(
             protocol = NFC_PROTOCOL_NFC_DEP;
             break;
         case NCI_PROTOCOL_ISO_DEP:
-            GDEBUG("Card emulation (ISO-DEP) not supported yet");
+            if (ntf->rf_intf == NCI_RF_INTERFACE_ISO_DEP &&
+                nci_adapter_apdu_handler_set(adapter)) {
+                protocol = (tech == NFC_TECHNOLOGY_B) ?
+                    NFC_PROTOCOL_T4B_TAG : NFC_PROTOCOL_T4A_TAG;
+            } else {
+                GDEBUG("Card emulation (ISO-DEP) is not enabled");
+            }
+            break;
+        case NCI_PROTOCOL_T3T:
+            if (tech == NFC_TECHNOLOGY_F &&
+                ntf->rf_intf == NCI_RF_INTERFACE_FRAME &&
+                ntf->mode_param && ntf->mode_param->listen_f.nfcid2.size ==
+                NCI_T3T_NFCID2_LEN && nci_adapter_t3t_store(adapter)) {
+                protocol = NFC_PROTOCOL_T3_TAG;
+            } else {
+                GDEBUG("Card emulation (T3T) is not enabled");
+            }
             break;
         default:
             GDEBUG("Unsupported initiator protocol 0x%02x", ntf->protocol);
@@ -185,7 +369,16 @@ nci_initiator_new(
             NciInitiator* self = nci_initiator_new_with_technology(tech);
             NfcInitiator* initiator = &self->initiator;
 
-            initiator->protocol = NFC_PROTOCOL_NFC_DEP;
+            initiator->protocol = protocol;
+            self->card_emulation = (protocol != NFC_PROTOCOL_NFC_DEP);
+            if (protocol == NFC_PROTOCOL_T4A_TAG ||
+                protocol == NFC_PROTOCOL_T4B_TAG) {
+                self->fwt_us = nci_adapter_listen_fwt(adapter, ntf->mode);
+            }
+            if (protocol == NFC_PROTOCOL_T3_TAG) {
+                memcpy(self->nfcid2, ntf->mode_param->listen_f.nfcid2.bytes,
+                    NCI_T3T_NFCID2_LEN);
+            }
             self->adapter = adapter;
             g_object_add_weak_pointer(G_OBJECT(adapter),
                 (gpointer*) &self->adapter);
@@ -198,6 +391,56 @@ nci_initiator_new(
     return NULL;
 }
 
+gboolean
+nci_initiator_respond_apdu_bytes(
+    NfcInitiator* initiator,
+    GBytes* bytes)
+{
+    if (G_LIKELY(initiator)) {
+        NciInitiator* self = THIS(initiator);
+
+        if (self->apdu_pending && self->adapter) {
+            gboolean ok = TRUE;
+
+            if (self->response_in_progress) {
+                /* Send it when the previous one is gone */
+                GASSERT(!self->apdu_queued);
+                self->apdu_queued = g_bytes_ref(bytes);
+            } else {
+                self->apdu_response = TRUE;
+                if (!nci_initiator_respond_bytes(self, bytes)) {
+                    self->apdu_response = FALSE;
+                    ok = FALSE;
+                }
+            }
+            if (ok) {
+                if (self->fwt_us) {
+                    nci_adapter_apdu_answered(self->adapter,
+                        (guint)(g_get_monotonic_time() - self->apdu_start),
+                        self->fwt_us);
+                }
+                nci_initiator_apdu_done(self);
+                return TRUE;
+            }
+            self->apdu_failed = TRUE;
+        }
+    }
+    return FALSE;
+}
+
+gboolean
+nci_initiator_respond_apdu(
+    NfcInitiator* initiator,
+    const void* data,
+    guint len)
+{
+    GBytes* bytes = g_bytes_new(data, len);
+    const gboolean ok = nci_initiator_respond_apdu_bytes(initiator, bytes);
+
+    g_bytes_unref(bytes);
+    return ok;
+}
+
 /*==========================================================================*
  * Methods
  *==========================================================================*/
@@ -210,20 +453,15 @@ nci_initiator_respond(
     guint len)
 {
     NciInitiator* self = THIS(initiator);
-    NciAdapter* adapter = self->adapter;
 
     GASSERT(!self->response_in_progress);
-
-    if (adapter) {
+    if (self->adapter) {
+        /* The caller keeps the ownership of the data, we need a copy */
         GBytes* bytes = g_bytes_new(data, len);
+        const gboolean ok = nci_initiator_respond_bytes(self, bytes);
 
-        self->response_in_progress = nci_core_send_data_msg(adapter->nci,
-            NCI_STATIC_RF_CONN_ID, bytes, nci_initiator_response_sent,
-            NULL, self);
         g_bytes_unref(bytes);
-        if (self->response_in_progress) {
-            return TRUE;
-        }
+        return ok;
     }
     return FALSE;
 }
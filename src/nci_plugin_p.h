@@ -37,7 +37,8 @@
 #ifndef NCI_PLUGIN_PRIVATE_H
 #define NCI_PLUGIN_PRIVATE_H
 
-#include <nci_plugin_types.h>
+#include "nci_adapter_impl.h"
+
 #include <nfc_types.h>
 
 typedef
@@ -47,6 +48,98 @@ void
     gboolean ok,
     void* user_data);
 
+/* Batches of commands executed back-to-back by NciTarget */
+
+typedef
+gboolean
+(*NciTargetResponseCheckFunc)(
+    const GUtilData* response);
+
+typedef struct nci_target_cmd {
+    GBytes* data;
+    NciTargetResponseCheckFunc check; /* Optional */
+    gboolean passive_ack; /* Silence means success, any response - NACK */
+} NciTargetCmd;
+
+typedef struct nci_target_batch_result {
+    NFC_TRANSMIT_STATUS status;
+    gboolean expected; /* Response has passed the check */
+    GUtilData data; /* Valid only for the duration of the callback */
+} NciTargetBatchResult;
+
+typedef enum nci_target_batch_flags {
+    NCI_TARGET_BATCH_FLAGS_NONE = 0x00,
+    NCI_TARGET_BATCH_STOP_ON_ERROR = 0x01
+} NCI_TARGET_BATCH_FLAGS;
+
+typedef
+void
+(*NciTargetBatchFunc)(
+    NfcTarget* target,
+    const NciTargetBatchResult* results,
+    guint count,
+    void* user_data);
+
+/* Type 2 tag specific stuff */
+
+typedef struct nci_target_t2 NciTargetT2;
+
+typedef
+void
+(*NciTargetT2ReadFunc)(
+    NfcTarget* target,
+    const GUtilData* data, /* NULL on failure */
+    void* user_data);
+
+typedef
+void
+(*NciTargetT2WriteFunc)(
+    NfcTarget* target,
+    gboolean ok,
+    guint written, /* Number of pages actually written */
+    void* user_data);
+
+/* AID routing table */
+
+typedef struct nci_aid_table NciAidTable;
+
+/* Read-only Type 4 NDEF tag emulation */
+
+typedef struct nci_t4_ndef NciT4Ndef;
+
+#define NCI_T4_NDEF_AID 0xd2, 0x76, 0x00, 0x00, 0x85, 0x01, 0x01
+
+/* Blocks of the emulated Type 3 tag */
+
+typedef struct nci_t3t_store NciT3tStore;
+
+#define NCI_T3T_NFCID2_LEN (8)
+#define NCI_T3T_BLOCK_SIZE (16)
+#define NCI_T3T_MAX_BLOCKS (15)
+#define NCI_T3T_MAX_RESPONSE (13 + NCI_T3T_MAX_BLOCKS * NCI_T3T_BLOCK_SIZE)
+
+/* Dynamic logical connection */
+
+typedef struct nci_conn NciConn;
+
+/* Set of UIDs */
+
+typedef struct nci_uid_filter NciUidFilter;
+
+/* Identity of the activated target, computed once per activation */
+
+/*
+ * RF_INTF_ACTIVATED_NTF fits into a single control packet (255 bytes
+ * of payload) and the fingerprint is never larger than its source.
+ */
+#define NCI_FINGERPRINT_MAX_SIZE (264)
+
+typedef struct nci_fingerprint {
+    guint hash;
+    guint size; /* Exceeding NCI_FINGERPRINT_MAX_SIZE means overflow */
+    guint8 data[NCI_FINGERPRINT_MAX_SIZE];
+} NciFingerprint;
+
 NfcTarget*
 nci_target_new(
     NciAdapter* adapter,
@@ -59,6 +152,19 @@ nci_initiator_new(
     const NciIntfActivationNtf* ntf)
     G_GNUC_INTERNAL;
 
+gboolean
+nci_initiator_respond_apdu(
+    NfcInitiator* initiator,
+    const void* data,
+    guint len)
+    G_GNUC_INTERNAL;
+
+gboolean
+nci_initiator_respond_apdu_bytes(
+    NfcInitiator* initiator,
+    GBytes* bytes)
+    G_GNUC_INTERNAL;
+
 guint
 nci_target_presence_check(
     NfcTarget* target,
@@ -66,6 +172,146 @@ nci_target_presence_check(
     void* user_data)
     G_GNUC_INTERNAL;
 
+void
+nci_target_cancel_presence_check(
+    NfcTarget* target,
+    guint id)
+    G_GNUC_INTERNAL;
+
+void
+nci_target_iso_dep_nak_presence(
+    NfcTarget* target,
+    gboolean present)
+    G_GNUC_INTERNAL;
+
+gint64
+nci_target_last_transmit_ok(
+    NfcTarget* target)
+    G_GNUC_INTERNAL;
+
+guint
+nci_target_transmit_batch(
+    NfcTarget* target,
+    const NciTargetCmd* cmds,
+    guint count,
+    NCI_TARGET_BATCH_FLAGS flags,
+    NciTargetBatchFunc done,
+    GDestroyNotify destroy,
+    void* user_data)
+    G_GNUC_INTERNAL;
+
+gboolean
+nci_target_cancel_batch(
+    NfcTarget* target,
+    guint id)
+    G_GNUC_INTERNAL;
+
+gboolean
+nci_target_reselect(
+    NfcTarget* target)
+    G_GNUC_INTERNAL;
+
+NciAdapter*
+nci_target_adapter(
+    NfcTarget* target)
+    G_GNUC_INTERNAL;
+
+NciTargetT2*
+nci_target_t2(
+    NfcTarget* target)
+    G_GNUC_INTERNAL;
+
+void
+nci_target_set_lost(
+    NfcTarget* target,
+    gboolean lost)
+    G_GNUC_INTERNAL;
+
+NciTargetT2*
+nci_target_t2_new(
+    NfcTarget* target)
+    G_GNUC_INTERNAL;
+
+void
+nci_target_t2_free(
+    NciTargetT2* t2)
+    G_GNUC_INTERNAL;
+
+guint
+nci_target_t2_read(
+    NciTargetT2* t2,
+    guint page,
+    guint count,
+    NciTargetT2ReadFunc done,
+    GDestroyNotify destroy,
+    void* user_data)
+    G_GNUC_INTERNAL;
+
+guint
+nci_target_t2_read_ahead(
+    NciTargetT2* t2,
+    const void* cmd,
+    guint len,
+    NciTargetT2ReadFunc done,
+    void* user_data)
+    G_GNUC_INTERNAL;
+
+void
+nci_target_t2_cancel_read(
+    NciTargetT2* t2,
+    guint id)
+    G_GNUC_INTERNAL;
+
+guint
+nci_target_t2_write(
+    NciTargetT2* t2,
+    guint page,
+    const void* data,
+    const void* prev,
+    guint size,
+    NciTargetT2WriteFunc done,
+    GDestroyNotify destroy,
+    void* user_data)
+    G_GNUC_INTERNAL;
+
+void
+nci_target_t2_cancel_write(
+    NciTargetT2* t2,
+    guint id)
+    G_GNUC_INTERNAL;
+
+void
+nci_target_t2_reactivated(
+    NciTargetT2* t2)
+    G_GNUC_INTERNAL;
+
+gboolean
+nci_target_t2_cached_response(
+    NciTargetT2* t2,
+    const void* cmd,
+    guint len,
+    GByteArray* response)
+    G_GNUC_INTERNAL;
+
+void
+nci_target_t2_cmd_sent(
+    NciTargetT2* t2,
+    const void* cmd,
+    guint len)
+    G_GNUC_INTERNAL;
+
+void
+nci_target_t2_cmd_done(
+    NciTargetT2* t2,
+    const GUtilData* response)
+    G_GNUC_INTERNAL;
+
+gboolean
+nci_adapter_iso_dep_nak_presence_check(
+    NciAdapter* adapter,
+    NfcTarget* target)
+    G_GNUC_INTERNAL;
+
 gboolean
 nci_adapter_reactivate(
     NciAdapter* adapter,
@@ -78,12 +324,261 @@ nci_adapter_deactivate_target(
     NfcTarget* target)
     G_GNUC_INTERNAL;
 
+void
+nci_adapter_target_transmit_error(
+    NciAdapter* adapter,
+    NfcTarget* target)
+    G_GNUC_INTERNAL;
+
+const NciFingerprint*
+nci_adapter_target_fingerprint(
+    NciAdapter* adapter)
+    G_GNUC_INTERNAL;
+
+gboolean
+nci_adapter_t2_no_version(
+    NciAdapter* adapter)
+    G_GNUC_INTERNAL;
+
+void
+nci_adapter_t2_set_no_version(
+    NciAdapter* adapter)
+    G_GNUC_INTERNAL;
+
+gboolean
+nci_adapter_apdu_handler_set(
+    NciAdapter* adapter)
+    G_GNUC_INTERNAL;
+
+gboolean
+nci_adapter_handle_apdu(
+    NciAdapter* adapter,
+    NfcInitiator* initiator,
+    const void* apdu,
+    guint len)
+    G_GNUC_INTERNAL;
+
+guint
+nci_adapter_listen_fwt(
+    NciAdapter* adapter,
+    NCI_MODE mode)
+    G_GNUC_INTERNAL;
+
+void
+nci_adapter_apdu_answered(
+    NciAdapter* adapter,
+    guint latency_us,
+    guint fwt_us)
+    G_GNUC_INTERNAL;
+
+gboolean
+nci_adapter_has_conn(
+    NciAdapter* adapter,
+    guint8 cid)
+    G_GNUC_INTERNAL;
+
+NciT3tStore*
+nci_adapter_t3t_store(
+    NciAdapter* adapter)
+    G_GNUC_INTERNAL;
+
 void
 nci_adapter_deactivate_initiator(
     NciAdapter* adapter,
     NfcInitiator* initiator)
     G_GNUC_INTERNAL;
 
+void
+nci_fingerprint_init(
+    NciFingerprint* fp,
+    const NciIntfActivationNtf* ntf)
+    G_GNUC_INTERNAL;
+
+guint
+nci_fingerprint_hash(
+    gconstpointer fp)
+    G_GNUC_INTERNAL;
+
+gboolean
+nci_fingerprint_equal(
+    gconstpointer fp1,
+    gconstpointer fp2)
+    G_GNUC_INTERNAL;
+
+NciAidTable*
+nci_aid_table_new(
+    GDestroyNotify destroy)
+    G_GNUC_INTERNAL;
+
+void
+nci_aid_table_free(
+    NciAidTable* table)
+    G_GNUC_INTERNAL;
+
+guint
+nci_aid_table_count(
+    const NciAidTable* table)
+    G_GNUC_INTERNAL;
+
+guint
+nci_aid_table_add(
+    NciAidTable* table,
+    const guint8* aid,
+    guint len,
+    gboolean prefix,
+    int priority,
+    gpointer data)
+    G_GNUC_INTERNAL;
+
+gboolean
+nci_aid_table_remove(
+    NciAidTable* table,
+    guint id)
+    G_GNUC_INTERNAL;
+
+gpointer
+nci_aid_table_lookup(
+    const NciAidTable* table,
+    const guint8* aid,
+    guint len)
+    G_GNUC_INTERNAL;
+
+NciT4Ndef*
+nci_t4_ndef_new_from_file(
+    const char* path)
+    G_GNUC_INTERNAL;
+
+void
+nci_t4_ndef_free(
+    NciT4Ndef* ndef)
+    G_GNUC_INTERNAL;
+
+void
+nci_t4_ndef_reset(
+    NciT4Ndef* ndef)
+    G_GNUC_INTERNAL;
+
+GBytes*
+nci_t4_ndef_process(
+    NciT4Ndef* ndef,
+    const guint8* apdu,
+    guint len)
+    G_GNUC_INTERNAL;
+
+NciT3tStore*
+nci_t3t_store_new(
+    void)
+    G_GNUC_INTERNAL;
+
+void
+nci_t3t_store_free(
+    NciT3tStore* store)
+    G_GNUC_INTERNAL;
+
+guint
+nci_t3t_store_count(
+    const NciT3tStore* store)
+    G_GNUC_INTERNAL;
+
+gboolean
+nci_t3t_store_add_service(
+    NciT3tStore* store,
+    guint16 code,
+    guint nblocks,
+    const void* data)
+    G_GNUC_INTERNAL;
+
+const guint8*
+nci_t3t_store_block(
+    NciT3tStore* store,
+    guint16 code,
+    guint block)
+    G_GNUC_INTERNAL;
+
+guint
+nci_t3t_store_process(
+    NciT3tStore* store,
+    const guint8* nfcid2,
+    const guint8* frame,
+    guint len,
+    guint8* resp)
+    G_GNUC_INTERNAL;
+
+NciConn*
+nci_conn_new(
+    NciAdapter* adapter,
+    guint id,
+    NciAdapterConnFunc state,
+    NciAdapterConnDataFunc data,
+    void* user_data)
+    G_GNUC_INTERNAL;
+
+void
+nci_conn_free(
+    NciConn* conn)
+    G_GNUC_INTERNAL;
+
+guint
+nci_conn_id(
+    const NciConn* conn)
+    G_GNUC_INTERNAL;
+
+int
+nci_conn_cid(
+    const NciConn* conn)
+    G_GNUC_INTERNAL;
+
+gboolean
+nci_conn_has_cid(
+    const NciConn* conn,
+    guint8 cid)
+    G_GNUC_INTERNAL;
+
+void
+nci_conn_created(
+    NciConn* conn,
+    gboolean ok,
+    guint8 cid,
+    guint max_payload)
+    G_GNUC_INTERNAL;
+
+void
+nci_conn_closed(
+    NciConn* conn)
+    G_GNUC_INTERNAL;
+
+void
+nci_conn_data(
+    NciConn* conn,
+    const void* data,
+    guint len)
+    G_GNUC_INTERNAL;
+
+void
+nci_conn_send(
+    NciConn* conn,
+    GBytes* bytes,
+    NciAdapterConnSendFunc done,
+    void* user_data)
+    G_GNUC_INTERNAL;
+
+NciUidFilter*
+nci_uid_filter_new_from_file(
+    const char* path)
+    G_GNUC_INTERNAL;
+
+void
+nci_uid_filter_free(
+    NciUidFilter* filter)
+    G_GNUC_INTERNAL;
+
+gboolean
+nci_uid_filter_contains(
+    const NciUidFilter* filter,
+    const guint8* uid,
+    guint len)
+    G_GNUC_INTERNAL;
+
 #endif /* NCI_PLUGIN_PRIVATE_H */
 
 /*
@@ -0,0 +1,398 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "nci_plugin_p.h"
+#include "nci_plugin_log.h"
+
+/*
+ * Blocks of the emulated Type 3 tag. Services are kept in a small open
+ * addressing hash table keyed by the service code, each service owns a
+ * contiguous array of 16-byte blocks. Locating a block is a hash probe
+ * plus array indexing, regardless of how many services and blocks are
+ * there.
+ *
+ * Frames (both commands and responses) start with the LEN byte, which
+ * counts itself.
+ */
+
+#define T3T_CMD_CHECK (0x06)
+#define T3T_RESP_CHECK (0x07)
+#define T3T_CMD_UPDATE (0x08)
+#define T3T_RESP_UPDATE (0x09)
+
+#define T3T_MAX_SERVICES (16)
+
+/* Bit 0 of the service code set means no authentication */
+#define T3T_SERVICE_NO_AUTH (0x0001)
+
+/* Status Flag 2 values (Status Flag 1 is 0xff) */
+#define T3T_STATUS_ILLEGAL_SERVICE_COUNT (0xa1)
+#define T3T_STATUS_ILLEGAL_BLOCK_COUNT (0xa2)
+#define T3T_STATUS_ILLEGAL_SERVICE (0xa6)
+#define T3T_STATUS_ILLEGAL_BLOCK (0xa8)
+
+/* Offsets within the command */
+#define T3T_CMD_HDR_LEN (2 + NCI_T3T_NFCID2_LEN) /* LEN, code, NFCID2 */
+#define T3T_RESP_HDR_LEN (T3T_CMD_HDR_LEN + 2) /* + Status Flags */
+
+typedef struct nci_t3t_service {
+    guint16 code;
+    gboolean used;
+    guint nblocks;
+    guint8* blocks;
+} NciT3tService;
+
+struct nci_t3t_store {
+    NciT3tService* services;
+    guint mask;
+    guint count;
+};
+
+typedef struct nci_t3t_block_ref {
+    NciT3tService* service;
+    guint block;
+} NciT3tBlockRef;
+
+static
+guint
+nci_t3t_store_slot(
+    guint16 code)
+{
+    /* Service number is in the upper 10 bits, attributes in the lower 6 */
+    return (code >> 6) ^ (code << 3) ^ code;
+}
+
+static
+NciT3tService*
+nci_t3t_store_find(
+    NciT3tStore* self,
+    guint16 code)
+{
+    guint i = nci_t3t_store_slot(code) & self->mask;
+
+    while (self->services[i].used) {
+        if (self->services[i].code == code) {
+            return self->services + i;
+        }
+        i = (i + 1) & self->mask;
+    }
+    return NULL;
+}
+
+static
+NciT3tService*
+nci_t3t_store_insert(
+    NciT3tStore* self,
+    guint16 code)
+{
+    guint i = nci_t3t_store_slot(code) & self->mask;
+
+    while (self->services[i].used) {
+        i = (i + 1) & self->mask;
+    }
+    self->services[i].used = TRUE;
+    self->services[i].code = code;
+    self->count++;
+    return self->services + i;
+}
+
+static
+void
+nci_t3t_store_grow(
+    NciT3tStore* self)
+{
+    NciT3tService* old = self->services;
+    const guint size = self->mask + 1;
+    guint i;
+
+    self->mask = 2 * size - 1;
+    self->services = g_new0(NciT3tService, 2 * size);
+    self->count = 0;
+    for (i = 0; i < size; i++) {
+        if (old[i].used) {
+            *nci_t3t_store_insert(self, old[i].code) = old[i];
+        }
+    }
+    g_free(old);
+}
+
+static
+guint
+nci_t3t_store_error(
+    guint8* resp,
+    guint8 code,
+    guint8 status)
+{
+    resp[0] = T3T_RESP_HDR_LEN;
+    resp[1] = code;
+    resp[T3T_CMD_HDR_LEN] = 0xff;
+    resp[T3T_CMD_HDR_LEN + 1] = status;
+    return T3T_RESP_HDR_LEN;
+}
+
+/* Returns the length of the block list or zero status on error */
+static
+guint
+nci_t3t_store_parse_blocks(
+    NciT3tStore* self,
+    const guint8* frame,
+    guint len,
+    gboolean update,
+    NciT3tBlockRef* refs,
+    guint* nblocks,
+    guint8* status)
+{
+    NciT3tService* services[T3T_MAX_SERVICES];
+    guint pos = T3T_CMD_HDR_LEN;
+    guint i, m, n;
+
+    /* Service Code List */
+    m = (pos < len) ? frame[pos++] : 0;
+    if (!m || m > T3T_MAX_SERVICES || pos + 2 * m >= len) {
+        *status = T3T_STATUS_ILLEGAL_SERVICE_COUNT;
+        return 0;
+    }
+    for (i = 0; i < m; i++, pos += 2) {
+        const guint16 code = frame[pos] | ((guint16)frame[pos + 1] << 8);
+
+        /* Only services which don't require authentication */
+        services[i] = (code & 0x01) ? nci_t3t_store_find(self, code) : NULL;
+        if (!services[i] || (update && (code & 0x02))) {
+            *status = T3T_STATUS_ILLEGAL_SERVICE;
+            return 0;
+        }
+    }
+
+    /* Block List */
+    n = frame[pos++];
+    if (!n || n > NCI_T3T_MAX_BLOCKS) {
+        *status = T3T_STATUS_ILLEGAL_BLOCK_COUNT;
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        const guint8 b0 = (pos < len) ? frame[pos] : 0xff;
+        const guint size = (b0 & 0x80) ? 2 : 3; /* Block List Element */
+        guint block;
+
+        if ((b0 & 0x70) || (b0 & 0x0f) >= m || pos + size > len) {
+            *status = T3T_STATUS_ILLEGAL_BLOCK;
+            return 0;
+        }
+        block = frame[pos + 1];
+        if (size == 3) {
+            block |= ((guint)frame[pos + 2] << 8);
+        }
+        pos += size;
+        refs[i].service = services[b0 & 0x0f];
+        refs[i].block = block;
+        if (block >= refs[i].service->nblocks) {
+            *status = T3T_STATUS_ILLEGAL_BLOCK;
+            return 0;
+        }
+    }
+    *nblocks = n;
+    return pos;
+}
+
+/*==========================================================================*
+ * Internal interface
+ *==========================================================================*/
+
+NciT3tStore*
+nci_t3t_store_new(
+    void)
+{
+    NciT3tStore* self = g_new0(NciT3tStore, 1);
+
+    self->mask = 7;
+    self->services = g_new0(NciT3tService, self->mask + 1);
+    return self;
+}
+
+void
+nci_t3t_store_free(
+    NciT3tStore* self)
+{
+    if (self) {
+        guint i;
+
+        for (i = 0; i <= self->mask; i++) {
+            g_free(self->services[i].blocks);
+        }
+        g_free(self->services);
+        g_free(self);
+    }
+}
+
+guint
+nci_t3t_store_count(
+    const NciT3tStore* self)
+{
+    return self ? self->count : 0;
+}
+
+gboolean
+nci_t3t_store_add_service(
+    NciT3tStore* self,
+    guint16 code,
+    guint nblocks,
+    const void* data)
+{
+    /* Services requiring authentication can't be emulated */
+    if (G_LIKELY(self) && (code & T3T_SERVICE_NO_AUTH) &&
+        nblocks > 0 && nblocks <= 0x10000) {
+        const gsize size = nblocks * NCI_T3T_BLOCK_SIZE;
+        NciT3tService* service = nci_t3t_store_find(self, code);
+
+        if (service) {
+            g_free(service->blocks);
+        } else {
+            /* Keep the load factor below 1/2 */
+            if (2 * (self->count + 1) > self->mask + 1) {
+                nci_t3t_store_grow(self);
+            }
+            service = nci_t3t_store_insert(self, code);
+        }
+        service->nblocks = nblocks;
+        if (data) {
+            service->blocks = g_malloc(size);
+            memcpy(service->blocks, data, size);
+        } else {
+            service->blocks = g_malloc0(size);
+        }
+        return TRUE;
+    }
+    return FALSE;
+}
+
+const guint8*
+nci_t3t_store_block(
+    NciT3tStore* self,
+    guint16 code,
+    guint block)
+{
+    if (G_LIKELY(self)) {
+        const NciT3tService* service = nci_t3t_store_find(self, code);
+
+        if (service && block < service->nblocks) {
+            return service->blocks + block * NCI_T3T_BLOCK_SIZE;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Handles Check and Update commands. The response buffer must be at
+ * least NCI_T3T_MAX_RESPONSE bytes long. Returns the response length,
+ * zero if the command is to be ignored (no response).
+ */
+guint
+nci_t3t_store_process(
+    NciT3tStore* self,
+    const guint8* nfcid2,
+    const guint8* frame,
+    guint len,
+    guint8* resp)
+{
+    NciT3tBlockRef refs[NCI_T3T_MAX_BLOCKS];
+    guint8 code, status = 0;
+    guint i, n = 0, pos;
+
+    /* NFCC may append the status byte, it has to be zero */
+    if (len < T3T_CMD_HDR_LEN || frame[0] < T3T_CMD_HDR_LEN ||
+        !(len == frame[0] || (len == frame[0] + 1u && !frame[len - 1]))) {
+        GDEBUG("Invalid T3T frame");
+        return 0;
+    }
+
+    /* Not addressed to us? */
+    len = frame[0];
+    if (memcmp(frame + 2, nfcid2, NCI_T3T_NFCID2_LEN)) {
+        return 0;
+    }
+
+    switch (frame[1]) {
+    case T3T_CMD_CHECK:
+        code = T3T_RESP_CHECK;
+        break;
+    case T3T_CMD_UPDATE:
+        code = T3T_RESP_UPDATE;
+        break;
+    default:
+        GDEBUG("Unsupported T3T command 0x%02x", frame[1]);
+        return 0;
+    }
+
+    memcpy(resp + 2, nfcid2, NCI_T3T_NFCID2_LEN);
+    pos = nci_t3t_store_parse_blocks(self, frame, len,
+        code == T3T_RESP_UPDATE, refs, &n, &status);
+    if (!pos) {
+        return nci_t3t_store_error(resp, code, status);
+    }
+
+    resp[1] = code;
+    resp[T3T_CMD_HDR_LEN] = resp[T3T_CMD_HDR_LEN + 1] = 0;
+    if (code == T3T_RESP_CHECK) {
+        guint8* out = resp + T3T_RESP_HDR_LEN;
+
+        *out++ = n;
+        for (i = 0; i < n; i++, out += NCI_T3T_BLOCK_SIZE) {
+            memcpy(out, refs[i].service->blocks + refs[i].block *
+                NCI_T3T_BLOCK_SIZE, NCI_T3T_BLOCK_SIZE);
+        }
+        resp[0] = out - resp;
+    } else if (pos + n * NCI_T3T_BLOCK_SIZE == len) {
+        /* The whole command has been validated, now it's safe to write */
+        for (i = 0; i < n; i++, pos += NCI_T3T_BLOCK_SIZE) {
+            memcpy(refs[i].service->blocks + refs[i].block *
+                NCI_T3T_BLOCK_SIZE, frame + pos, NCI_T3T_BLOCK_SIZE);
+        }
+        resp[0] = T3T_RESP_HDR_LEN;
+    } else {
+        return nci_t3t_store_error(resp, code,
+            T3T_STATUS_ILLEGAL_BLOCK_COUNT);
+    }
+    return resp[0];
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "nci_plugin_p.h"
+#include "nci_plugin_log.h"
+
+#include <gutil_misc.h>
+
+/*
+ * Read-only NFC Forum Type 4 Tag, mapping version 2.0. The image is the
+ * contents of the NDEF file, i.e. 2 bytes of NLEN (big-endian) followed
+ * by the NDEF message. It's mapped into memory and never copied as a
+ * whole. R-APDUs are cached, readers tend to read the same tag in the
+ * same chunks, so after the first read the responses are ready to go.
+ */
+
+#define T4_CC_FID (0xe103)
+#define T4_NDEF_FID (0xe104)
+#define T4_MAX_FILE_SIZE (0xfffe)
+#define T4_MLE (0xff)
+
+#define RESPONSE_CACHE_SIZE (8)
+
+typedef enum nci_t4_ndef_file {
+    T4_FILE_NONE,
+    T4_FILE_CC,
+    T4_FILE_NDEF
+} T4_FILE;
+
+typedef struct nci_t4_ndef_response {
+    GBytes* bytes;
+    T4_FILE file;
+    guint offset;
+    guint size;
+} NciT4NdefResponse;
+
+struct nci_t4_ndef {
+    GMappedFile* map;
+    GUtilData ndef;
+    guint8 cc[15];
+    gboolean app_selected;
+    T4_FILE file;
+    GBytes* sw_ok;
+    GBytes* sw_not_found;
+    GBytes* sw_wrong_params;
+    GBytes* sw_no_ef;
+    GBytes* sw_denied;
+    GBytes* sw_ins_not_supported;
+    NciT4NdefResponse cache[RESPONSE_CACHE_SIZE];
+    guint cache_next;
+};
+
+static const guint8 sw_ok[] = { 0x90, 0x00 };
+static const guint8 sw_not_found[] = { 0x6a, 0x82 };
+static const guint8 sw_wrong_params[] = { 0x6b, 0x00 };
+static const guint8 sw_no_ef[] = { 0x69, 0x86 };
+static const guint8 sw_denied[] = { 0x69, 0x82 };
+static const guint8 sw_ins_not_supported[] = { 0x6d, 0x00 };
+
+static
+const GUtilData*
+nci_t4_ndef_file_data(
+    NciT4Ndef* self,
+    GUtilData* data)
+{
+    switch (self->file) {
+    case T4_FILE_CC:
+        data->bytes = self->cc;
+        data->size = sizeof(self->cc);
+        return data;
+    case T4_FILE_NDEF:
+        *data = self->ndef;
+        return data;
+    case T4_FILE_NONE:
+        break;
+    }
+    return NULL;
+}
+
+static
+GBytes*
+nci_t4_ndef_read(
+    NciT4Ndef* self,
+    guint offset,
+    guint le)
+{
+    GUtilData data;
+    guint i, size;
+    guint8* buf;
+    NciT4NdefResponse* r;
+
+    if (!nci_t4_ndef_file_data(self, &data)) {
+        return self->sw_no_ef;
+    } else if (offset > data.size) {
+        return self->sw_wrong_params;
+    }
+
+    size = MIN(le, data.size - offset);
+    for (i = 0; i < RESPONSE_CACHE_SIZE; i++) {
+        r = self->cache + i;
+        if (r->bytes && r->file == self->file && r->offset == offset &&
+            r->size == size) {
+            return r->bytes;
+        }
+    }
+
+    /* Cache miss, replace the oldest entry */
+    r = self->cache + self->cache_next;
+    self->cache_next = (self->cache_next + 1) % RESPONSE_CACHE_SIZE;
+    if (r->bytes) {
+        g_bytes_unref(r->bytes);
+    }
+    buf = g_malloc(size + sizeof(sw_ok));
+    memcpy(buf, data.bytes + offset, size);
+    memcpy(buf + size, sw_ok, sizeof(sw_ok));
+    r->bytes = g_bytes_new_take(buf, size + sizeof(sw_ok));
+    r->file = self->file;
+    r->offset = offset;
+    r->size = size;
+    return r->bytes;
+}
+
+static
+GBytes*
+nci_t4_ndef_select(
+    NciT4Ndef* self,
+    const guint8* apdu,
+    guint len)
+{
+    const guint p1 = apdu[2];
+    const guint lc = (len > 4) ? apdu[4] : 0;
+    const guint8* data = apdu + 5;
+
+    if (len < 5 + lc) {
+        return self->sw_wrong_params;
+    }
+    switch (p1) {
+    case 0x04: /* By DF name, the AID has been matched by the adapter */
+        self->app_selected = TRUE;
+        self->file = T4_FILE_NONE;
+        return self->sw_ok;
+    case 0x00: /* By file identifier */
+        if (self->app_selected && lc == 2) {
+            const guint fid = ((guint)data[0] << 8) | data[1];
+
+            if (fid == T4_CC_FID) {
+                self->file = T4_FILE_CC;
+                return self->sw_ok;
+            } else if (fid == T4_NDEF_FID) {
+                self->file = T4_FILE_NDEF;
+                return self->sw_ok;
+            }
+        }
+        self->file = T4_FILE_NONE;
+        return self->sw_not_found;
+    }
+    return self->sw_wrong_params;
+}
+
+/*==========================================================================*
+ * Internal interface
+ *==========================================================================*/
+
+NciT4Ndef*
+nci_t4_ndef_new_from_file(
+    const char* path)
+{
+    GError* error = NULL;
+    GMappedFile* map = g_mapped_file_new(path, FALSE, &error);
+
+    if (map) {
+        const guint8* ptr = (void*) g_mapped_file_get_contents(map);
+        const gsize size = g_mapped_file_get_length(map);
+
+        /* NLEN must be there and must match the file */
+        if (size >= 2 && size <= T4_MAX_FILE_SIZE &&
+            (((guint)ptr[0] << 8) | ptr[1]) <= (size - 2)) {
+            NciT4Ndef* self = g_new0(NciT4Ndef, 1);
+            guint8* cc = self->cc;
+
+            self->map = map;
+            self->ndef.bytes = ptr;
+            self->ndef.size = size;
+
+            /* Capability Container */
+            cc[0] = 0x00; cc[1] = sizeof(self->cc); /* CCLEN */
+            cc[2] = 0x20; /* Mapping version 2.0 */
+            cc[3] = 0x00; cc[4] = T4_MLE; /* MLe */
+            cc[5] = 0x00; cc[6] = 0xff; /* MLc */
+            cc[7] = 0x04; cc[8] = 0x06; /* NDEF File Control TLV */
+            cc[9] = (guint8)(T4_NDEF_FID >> 8);
+            cc[10] = (guint8)T4_NDEF_FID;
+            cc[11] = (guint8)(size >> 8); cc[12] = (guint8)size;
+            cc[13] = 0x00; /* Read access granted */
+            cc[14] = 0xff; /* No write access */
+
+            self->sw_ok = g_bytes_new_static(sw_ok, sizeof(sw_ok));
+            self->sw_not_found = g_bytes_new_static(sw_not_found,
+                sizeof(sw_not_found));
+            self->sw_wrong_params = g_bytes_new_static(sw_wrong_params,
+                sizeof(sw_wrong_params));
+            self->sw_no_ef = g_bytes_new_static(sw_no_ef,
+                sizeof(sw_no_ef));
+            self->sw_denied = g_bytes_new_static(sw_denied,
+                sizeof(sw_denied));
+            self->sw_ins_not_supported = g_bytes_new_static(
+                sw_ins_not_supported, sizeof(sw_ins_not_supported));
+            GDEBUG("Type 4 NDEF image %s, %u byte(s)", path, (guint)size);
+            return self;
+        }
+        GERR("%s: not a valid NDEF file image", path);
+        g_mapped_file_unref(map);
+    } else {
+        GERR("%s", error->message);
+        g_error_free(error);
+    }
+    return NULL;
+}
+
+void
+nci_t4_ndef_free(
+    NciT4Ndef* self)
+{
+    if (self) {
+        int i;
+
+        for (i = 0; i < RESPONSE_CACHE_SIZE; i++) {
+            if (self->cache[i].bytes) {
+                g_bytes_unref(self->cache[i].bytes);
+            }
+        }
+        g_bytes_unref(self->sw_ok);
+        g_bytes_unref(self->sw_not_found);
+        g_bytes_unref(self->sw_wrong_params);
+        g_bytes_unref(self->sw_no_ef);
+        g_bytes_unref(self->sw_denied);
+        g_bytes_unref(self->sw_ins_not_supported);
+        g_mapped_file_unref(self->map);
+        g_free(self);
+    }
+}
+
+void
+nci_t4_ndef_reset(
+    NciT4Ndef* self)
+{
+    if (self) {
+        self->app_selected = FALSE;
+        self->file = T4_FILE_NONE;
+    }
+}
+
+/* Returns the R-APDU, the caller doesn't own the reference */
+GBytes*
+nci_t4_ndef_process(
+    NciT4Ndef* self,
+    const guint8* apdu,
+    guint len)
+{
+    if (len < 4 || (apdu[0] & 0x80)) {
+        return self->sw_ins_not_supported;
+    }
+    switch (apdu[1]) {
+    case 0xa4: /* SELECT */
+        return nci_t4_ndef_select(self, apdu, len);
+    case 0xb0: /* READ BINARY */
+        if (!(apdu[2] & 0x80) && len <= 5) {
+            /* Le of zero (or no Le at all) means 256 */
+            return nci_t4_ndef_read(self, ((guint)apdu[2] << 8) | apdu[3],
+                (len == 5 && apdu[4]) ? apdu[4] : 256);
+        }
+        return self->sw_wrong_params;
+    case 0xd6: /* UPDATE BINARY */
+        return self->sw_denied;
+    }
+    return self->sw_ins_not_supported;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -43,7 +43,15 @@
 
 #include <nfc_target_impl.h>
 
+#define T1T_CMD_RID (0x78)
 #define T2T_CMD_READ (0x30)
+#define T3T_CMD_CHECK (0x06)
+#define T3T_SERVICE_CODE_RO (0x000b) /* NDEF, read-only */
+#define T3T_IDM_SIZE (8)
+
+#define NAK_PRESENCE_CHECK_TIMEOUT_MS (1000)
+#define BATCH_STEP_TIMEOUT_MS (1000)
+#define PASSIVE_ACK_TIMEOUT_MS (20)
 
 enum {
     EVENT_DATA_PACKET,
@@ -67,19 +75,53 @@ guint
 typedef
 gboolean
 (*NciTargetTransmitFinishFunc)(
-    NfcTarget* target,
+    GUtilData* data,
     const guint8* payload,
     guint len);
 
+typedef struct nci_target_batch {
+    guint id;
+    guint count;
+    guint pos;
+    gboolean running;
+    gboolean after_deferred; /* Submitted after deferred transmission */
+    guint timeout_id;
+    guint ack_timer_id;
+    NCI_TARGET_BATCH_FLAGS flags;
+    NciTargetCmd* cmds;
+    NciTargetBatchResult* results;
+    GByteArray* buf;
+    NciTargetBatchFunc done;
+    GDestroyNotify destroy;
+    void* user_data;
+} NciTargetBatch;
+
 struct nci_target {
     NfcTarget target;
     NciAdapter* adapter;
     gulong event_id[EVENT_COUNT];
     guint send_in_progress;
     gboolean transmit_in_progress;
-    GBytes* pending_reply; /* Reply arrived before send has completed */
+    gint64 last_transmit_ok; /* Monotonic time of the last good reply */
+    gboolean reply_pending; /* Reply arrived before send has completed */
+    GByteArray* reply_buf; /* Reused for early replies */
+    guint reply_count;
+    guint early_reply_count;
     NciTargetPresenceCheckFunc presence_check_fn;
     NciTargetTransmitFinishFunc transmit_finish_fn;
+    NciTargetPresenceCheck* nak_check; /* ISO-DEP NAK presence check */
+    guint nak_check_timeout; /* Doubles as the presence check id */
+    guint8 t3t_idm[T3T_IDM_SIZE]; /* For T3T presence checks */
+    NciTargetBatch* batch; /* Pending or running batch */
+    NciTargetBatch* next_batch; /* Presence check waiting for the batch */
+    GBytes* deferred; /* NfcTarget transmission waiting for the batch */
+    NciTargetT2* t2; /* Type 2 specific extensions */
+    GBytes* read_ahead_cmd; /* NfcTarget READ waiting for read ahead */
+    guint read_ahead_id; /* T2 read filling the page cache */
+    GByteArray* cached_reply; /* Reply taken from the T2 page cache */
+    guint cached_reply_id; /* Idle source completing the transmission */
+    guint presence_batch_id; /* Batch doubling as a presence check */
+    gboolean lost; /* Waiting for the target to reappear */
 };
 
 GType nci_target_get_type(void) G_GNUC_INTERNAL;
@@ -139,11 +181,433 @@ nci_target_cancel_send(
             nci_core_cancel(self->adapter->nci, self->send_in_progress);
         }
         self->send_in_progress = 0;
-        if (self->pending_reply) {
-            g_bytes_unref(self->pending_reply);
-            self->pending_reply = NULL;
+        self->reply_pending = FALSE;
+    }
+}
+
+static
+gboolean
+nci_target_send_bytes(
+    NciTarget* self,
+    GBytes* bytes);
+
+static
+NciTargetBatch*
+nci_target_batch_new(
+    const NciTargetCmd* cmds,
+    guint count,
+    NCI_TARGET_BATCH_FLAGS flags,
+    NciTargetBatchFunc done,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    static guint nci_target_batch_last_id = 0;
+
+    /* Allocate the whole thing from a single memory block */
+    const gsize total = G_ALIGN8(sizeof(NciTargetBatch)) +
+        G_ALIGN8(sizeof(NciTargetCmd) * count) +
+        sizeof(NciTargetBatchResult) * count;
+    NciTargetBatch* batch = g_malloc0(total);
+    guint8* ptr = (guint8*)batch;
+    guint i;
+
+    ptr += G_ALIGN8(sizeof(NciTargetBatch));
+    batch->cmds = (NciTargetCmd*)ptr;
+    ptr += G_ALIGN8(sizeof(NciTargetCmd) * count);
+    batch->results = (NciTargetBatchResult*)ptr;
+    for (i = 0; i < count; i++) {
+        batch->cmds[i].data = g_bytes_ref(cmds[i].data);
+        batch->cmds[i].check = cmds[i].check;
+        batch->cmds[i].passive_ack = cmds[i].passive_ack;
+    }
+
+    /* Zero id is reserved */
+    batch->id = ++nci_target_batch_last_id;
+    if (!batch->id) {
+        batch->id = ++nci_target_batch_last_id;
+    }
+    batch->count = count;
+    batch->flags = flags;
+    batch->buf = g_byte_array_new();
+    batch->done = done;
+    batch->destroy = destroy;
+    batch->user_data = user_data;
+    return batch;
+}
+
+static
+void
+nci_target_batch_free(
+    NciTargetBatch* batch)
+{
+    guint i;
+
+    if (batch->timeout_id) {
+        g_source_remove(batch->timeout_id);
+    }
+    if (batch->ack_timer_id) {
+        g_source_remove(batch->ack_timer_id);
+    }
+    if (batch->destroy) {
+        batch->destroy(batch->user_data);
+    }
+    for (i = 0; i < batch->count; i++) {
+        g_bytes_unref(batch->cmds[i].data);
+    }
+    g_byte_array_free(batch->buf, TRUE);
+    g_free(batch);
+}
+
+static
+void
+nci_target_resume(
+    NciTarget* self);
+
+static
+void
+nci_target_batch_finish(
+    NciTarget* self)
+{
+    NciTargetBatch* batch = self->batch;
+    const guint8* ptr = batch->buf->data;
+    guint i;
+
+    /* Responses have been accumulated in a single buffer */
+    self->batch = NULL;
+    for (i = 0; i < batch->pos; i++) {
+        NciTargetBatchResult* result = batch->results + i;
+
+        result->data.bytes = result->data.size ? ptr : NULL;
+        ptr += result->data.size;
+    }
+    GDEBUG("Batch %u done, %u/%u command(s)", batch->id, batch->pos,
+        batch->count);
+    if (batch->done) {
+        batch->done(&self->target, batch->results, batch->pos,
+            batch->user_data);
+    }
+    nci_target_batch_free(batch);
+    nci_target_resume(self);
+}
+
+static
+void
+nci_target_batch_fail_step(
+    NciTarget* self,
+    NFC_TRANSMIT_STATUS status)
+{
+    NciTargetBatch* batch = self->batch;
+
+    batch->results[batch->pos++].status = status;
+    nci_target_batch_finish(self);
+}
+
+static
+gboolean
+nci_target_batch_timeout(
+    gpointer user_data)
+{
+    NciTarget* self = THIS(user_data);
+    NciTargetBatch* batch = self->batch;
+
+    GDEBUG("Batch %u timed out at step %u", batch->id, batch->pos);
+    batch->timeout_id = 0;
+    nci_target_cancel_send(self);
+    self->transmit_in_progress = FALSE;
+    nci_target_batch_fail_step(self, NFC_TRANSMIT_STATUS_TIMEOUT);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+nci_target_batch_send(
+    NciTarget* self)
+{
+    NciTargetBatch* batch = self->batch;
+
+    if (!nci_target_send_bytes(self, batch->cmds[batch->pos].data)) {
+        nci_target_batch_fail_step(self, NFC_TRANSMIT_STATUS_ERROR);
+    }
+}
+
+static
+gboolean
+nci_target_batch_start(
+    NciTarget* self)
+{
+    NciTargetBatch* batch = self->batch;
+
+    /* One timer for the whole batch, to keep the steps cheap */
+    GDEBUG("Starting batch %u", batch->id);
+    batch->running = TRUE;
+    batch->timeout_id = g_timeout_add(BATCH_STEP_TIMEOUT_MS * batch->count,
+        nci_target_batch_timeout, self);
+    return nci_target_send_bytes(self, batch->cmds[0].data);
+}
+
+static
+void
+nci_target_batch_next(
+    NciTarget* self,
+    gboolean ok)
+{
+    NciTargetBatch* batch = self->batch;
+
+    batch->pos++;
+    if (batch->pos == batch->count ||
+        (!ok && (batch->flags & NCI_TARGET_BATCH_STOP_ON_ERROR))) {
+        nci_target_batch_finish(self);
+    } else {
+        /* Send the next one straight away */
+        nci_target_batch_send(self);
+    }
+}
+
+static
+void
+nci_target_batch_step_done(
+    NciTarget* self,
+    const GUtilData* data)
+{
+    NciTargetBatch* batch = self->batch;
+    NciTargetBatchResult* result = batch->results + batch->pos;
+    const NciTargetCmd* cmd = batch->cmds + batch->pos;
+
+    if (batch->ack_timer_id) {
+        g_source_remove(batch->ack_timer_id);
+        batch->ack_timer_id = 0;
+    }
+    if (data) {
+        result->status = NFC_TRANSMIT_STATUS_OK;
+        if (cmd->passive_ack) {
+            /* Any response means NACK */
+            GDEBUG("Batch %u step %u NACK'ed", batch->id, batch->pos);
+            result->expected = FALSE;
+        } else {
+            result->expected = !cmd->check || cmd->check(data);
+        }
+        result->data.size = data->size;
+        g_byte_array_append(batch->buf, data->bytes, data->size);
+    } else {
+        result->status = NFC_TRANSMIT_STATUS_ERROR;
+    }
+    nci_target_batch_next(self, result->expected);
+}
+
+static
+gboolean
+nci_target_batch_passive_ack(
+    gpointer user_data)
+{
+    NciTarget* self = THIS(user_data);
+    NciTargetBatch* batch = self->batch;
+    NciTargetBatchResult* result = batch->results + batch->pos;
+
+    /* No response within the timeout, that's an ACK */
+    batch->ack_timer_id = 0;
+    self->transmit_in_progress = FALSE;
+    result->status = NFC_TRANSMIT_STATUS_OK;
+    result->expected = TRUE;
+    nci_target_batch_next(self, TRUE);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+nci_target_abort_next_batch(
+    NciTarget* self,
+    gboolean notify)
+{
+    NciTargetBatch* batch = self->next_batch;
+
+    if (batch) {
+        /* It hasn't even started */
+        self->next_batch = NULL;
+        if (notify && batch->done) {
+            batch->done(&self->target, batch->results, 0, batch->user_data);
+        }
+        nci_target_batch_free(batch);
+    }
+}
+
+static
+void
+nci_target_abort_batch(
+    NciTarget* self,
+    gboolean notify)
+{
+    NciTargetBatch* batch = self->batch;
+
+    if (batch) {
+        if (batch->running) {
+            nci_target_cancel_send(self);
+            self->transmit_in_progress = FALSE;
+        }
+        if (notify) {
+            nci_target_batch_fail_step(self, NFC_TRANSMIT_STATUS_ERROR);
+        } else {
+            self->batch = NULL;
+            nci_target_batch_free(batch);
+        }
+    }
+}
+
+static
+void
+nci_target_resume(
+    NciTarget* self)
+{
+    if (!self->transmit_in_progress && !self->lost) {
+        NciTargetBatch* batch = self->batch;
+
+        if (!batch && self->next_batch) {
+            /* Presence check has been waiting for the previous batch */
+            batch = self->batch = self->next_batch;
+            self->next_batch = NULL;
+        }
+
+        /* Whatever has been submitted first, goes first */
+        if (batch && !batch->running &&
+            !(batch->after_deferred && self->deferred)) {
+            if (!nci_target_batch_start(self)) {
+                nci_target_batch_fail_step(self, NFC_TRANSMIT_STATUS_ERROR);
+            }
+        } else if (self->deferred) {
+            GBytes* bytes = self->deferred;
+
+            /* NfcTarget transmission has been waiting for the batch */
+            self->deferred = NULL;
+            nci_target_t2_cmd_sent(self->t2, g_bytes_get_data(bytes, NULL),
+                g_bytes_get_size(bytes));
+            if (!nci_target_send_bytes(self, bytes)) {
+                nfc_target_transmit_done(&self->target,
+                    NFC_TRANSMIT_STATUS_ERROR, NULL, 0);
+            }
+            g_bytes_unref(bytes);
+        }
+    }
+}
+
+static
+void
+nci_target_cancel_nak_check(
+    NciTarget* self)
+{
+    if (self->nak_check) {
+        nci_target_presence_check_free(self->nak_check);
+        self->nak_check = NULL;
+    }
+    if (self->nak_check_timeout) {
+        g_source_remove(self->nak_check_timeout);
+        self->nak_check_timeout = 0;
+    }
+}
+
+static
+void
+nci_target_finish_nak_check(
+    NciTarget* self,
+    gboolean present)
+{
+    NciTargetPresenceCheck* check = self->nak_check;
+
+    if (check) {
+        self->nak_check = NULL;
+        if (self->nak_check_timeout) {
+            g_source_remove(self->nak_check_timeout);
+            self->nak_check_timeout = 0;
+        }
+        check->done(&self->target, present, check->user_data);
+        nci_target_presence_check_free(check);
+    }
+}
+
+static
+gboolean
+nci_target_nak_check_timeout(
+    gpointer user_data)
+{
+    NciTarget* self = THIS(user_data);
+
+    GDEBUG("ISO-DEP NAK presence check timed out");
+    self->nak_check_timeout = 0;
+    nci_target_finish_nak_check(self, FALSE);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+nci_target_cancel_cached_reply(
+    NciTarget* self)
+{
+    if (self->cached_reply_id) {
+        g_source_remove(self->cached_reply_id);
+        self->cached_reply_id = 0;
+    }
+}
+
+static
+gboolean
+nci_target_cached_reply(
+    gpointer user_data)
+{
+    NciTarget* self = THIS(user_data);
+    GByteArray* reply = self->cached_reply;
+
+    self->cached_reply_id = 0;
+    nfc_target_transmit_done(&self->target, NFC_TRANSMIT_STATUS_OK,
+        reply->data, reply->len);
+    nci_target_resume(self);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+nci_target_cancel_read_ahead(
+    NciTarget* self)
+{
+    if (self->read_ahead_id) {
+        const guint id = self->read_ahead_id;
+
+        self->read_ahead_id = 0;
+        nci_target_t2_cancel_read(self->t2, id);
+    }
+    if (self->read_ahead_cmd) {
+        g_bytes_unref(self->read_ahead_cmd);
+        self->read_ahead_cmd = NULL;
+    }
+}
+
+static
+void
+nci_target_read_ahead_done(
+    NfcTarget* target,
+    const GUtilData* data,
+    void* user_data)
+{
+    NciTarget* self = THIS(user_data);
+    GBytes* bytes = self->read_ahead_cmd;
+    gsize len;
+    const void* cmd = g_bytes_get_data(bytes, &len);
+
+    /* Whether or not the read has worked, the cache knows what we have */
+    self->read_ahead_id = 0;
+    self->read_ahead_cmd = NULL;
+    if (nci_target_t2_cached_response(self->t2, cmd, len,
+        self->cached_reply)) {
+        self->cached_reply_id = g_idle_add(nci_target_cached_reply, self);
+    } else if (self->lost) {
+        /* Wait for the target to reappear */
+        GASSERT(!self->deferred);
+        self->deferred = g_bytes_ref(bytes);
+    } else {
+        nci_target_t2_cmd_sent(self->t2, cmd, len);
+        if (!nci_target_send_bytes(self, bytes)) {
+            nfc_target_transmit_done(target, NFC_TRANSMIT_STATUS_ERROR,
+                NULL, 0);
         }
     }
+    g_bytes_unref(bytes);
 }
 
 static
@@ -151,6 +615,13 @@ void
 nci_target_drop_adapter(
     NciTarget* self)
 {
+    nci_target_cancel_nak_check(self);
+    nci_target_cancel_cached_reply(self);
+    if (self->deferred) {
+        g_bytes_unref(self->deferred);
+        self->deferred = NULL;
+    }
+    nci_target_cancel_read_ahead(self);
     if (self->adapter) {
         NciAdapter* adapter = self->adapter;
 
@@ -170,11 +641,29 @@ nci_target_finish_transmit(
     guint len)
 {
     NfcTarget* target = &self->target;
+    GUtilData data;
+    const gboolean ok = self->transmit_finish_fn &&
+        self->transmit_finish_fn(&data, payload, len);
 
     self->transmit_in_progress = FALSE;
-    if (!self->transmit_finish_fn ||
-        !self->transmit_finish_fn(target, payload, len)) {
-        nfc_target_transmit_done(target, NFC_TRANSMIT_STATUS_ERROR, NULL, 0);
+    if (ok) {
+        self->last_transmit_ok = g_get_monotonic_time();
+    } else {
+        nci_adapter_target_transmit_error(self->adapter, target);
+    }
+    if (self->batch && self->batch->running) {
+        nci_target_batch_step_done(self, ok ? &data : NULL);
+    } else {
+        nci_target_t2_cmd_done(self->t2, ok ? &data : NULL);
+        if (ok) {
+            nfc_target_transmit_done(target, NFC_TRANSMIT_STATUS_OK,
+                data.bytes, data.size);
+        } else {
+            nfc_target_transmit_done(target, NFC_TRANSMIT_STATUS_ERROR,
+                NULL, 0);
+        }
+        /* Start the batch if it has been waiting for this transmission */
+        nci_target_resume(self);
     }
 }
 
@@ -190,16 +679,24 @@ nci_target_data_sent(
     GASSERT(self->send_in_progress);
     self->send_in_progress = 0;
 
-    if (self->pending_reply) {
-        gsize len;
-        GBytes* reply = self->pending_reply;
-        const guint8* payload = g_bytes_get_data(reply, &len);
+    if (self->batch && self->batch->running && !self->reply_pending &&
+        self->batch->cmds[self->batch->pos].passive_ack) {
+        /* Wait a bit for NACK */
+        self->batch->ack_timer_id = g_timeout_add(PASSIVE_ACK_TIMEOUT_MS,
+            nci_target_batch_passive_ack, self);
+    }
+
+    if (self->reply_pending) {
+        const GByteArray* reply = self->reply_buf;
 
-        /* We have been waiting for this send to complete */
+        /*
+         * We have been waiting for this send to complete. The buffer
+         * can't be overwritten until the next send completes, so it's
+         * safe to pass its contents directly.
+         */
         GDEBUG("Send completed");
-        self->pending_reply = NULL;
-        nci_target_finish_transmit(self, payload, len);
-        g_bytes_unref(reply);
+        self->reply_pending = FALSE;
+        nci_target_finish_transmit(self, reply->data, reply->len);
     }
 }
 
@@ -215,20 +712,30 @@ nci_target_data_packet_handler(
     NciTarget* self = THIS(user_data);
 
     if (cid == NCI_STATIC_RF_CONN_ID && self->transmit_in_progress &&
-        !self->pending_reply) {
+        !self->reply_pending) {
+        self->reply_count++;
         if (G_UNLIKELY(self->send_in_progress)) {
             /*
              * Due to multi-threaded nature of pn547 driver and services,
              * incoming reply transactions sometimes get handled before
              * send completion callback has been invoked. Postpone transfer
-             * completion until then.
+             * completion until then. The buffer is allocated once and
+             * then reused, it only gets reallocated if it needs to grow.
              */
-            GDEBUG("Waiting for send to complete");
-            self->pending_reply = g_bytes_new(data, len);
+            self->early_reply_count++;
+            GDEBUG("Waiting for send to complete (%u/%u)",
+                self->early_reply_count, self->reply_count);
+            if (!self->reply_buf) {
+                self->reply_buf = g_byte_array_sized_new(len);
+            }
+            g_byte_array_set_size(self->reply_buf, 0);
+            g_byte_array_append(self->reply_buf, data, len);
+            self->reply_pending = TRUE;
         } else {
             nci_target_finish_transmit(self, data, len);
         }
-    } else {
+    } else if (!nci_adapter_has_conn(self->adapter, cid)) {
+        /* Dynamic connections are handled by NciAdapter */
         GDEBUG("Unhandled data packet, cid=0x%02x %u byte(s)", cid, len);
     }
 }
@@ -247,6 +754,37 @@ nci_target_presence_check_complete(
     check->done(target, status == NFC_TRANSMIT_STATUS_OK, check->user_data);
 }
 
+static
+guint
+nci_target_presence_check_t1(
+    NciTarget* self,
+    NciTargetPresenceCheck* check)
+{
+    /* RID command, the rest is zero-filled (ADD, DATA and UID echo) */
+    static const guint8 cmd_data[] = {
+        T1T_CMD_RID, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+
+    return nfc_target_transmit(&self->target, cmd_data, sizeof(cmd_data),
+        NULL, nci_target_presence_check_complete,
+        nci_target_presence_check_free1, check);
+}
+
+static
+void
+nci_target_presence_check_batch_done(
+    NfcTarget* target,
+    const NciTargetBatchResult* results,
+    guint count,
+    void* user_data)
+{
+    NciTargetPresenceCheck* check = user_data;
+
+    THIS(target)->presence_batch_id = 0;
+    check->done(target, count && results->status == NFC_TRANSMIT_STATUS_OK,
+        check->user_data);
+}
+
 static
 guint
 nci_target_presence_check_t2(
@@ -254,7 +792,64 @@ nci_target_presence_check_t2(
     NciTargetPresenceCheck* check)
 {
     static const guint8 cmd_data[] = { T2T_CMD_READ, 0x00 };
+    NciTargetCmd cmd;
 
+    /*
+     * Sent as a batch so that it doesn't get answered by the page cache
+     * and doesn't have to wait in NfcTarget queue. It's still subject
+     * to sector selection, but either way the tag has to respond.
+     */
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.data = g_bytes_new_static(cmd_data, sizeof(cmd_data));
+    if (!self->batch) {
+        self->presence_batch_id = nci_target_transmit_batch(&self->target,
+            &cmd, 1, NCI_TARGET_BATCH_FLAGS_NONE,
+            nci_target_presence_check_batch_done,
+            nci_target_presence_check_free1, check);
+    } else if (!self->next_batch && self->adapter) {
+        /* The tag is busy with a batch, this one goes next */
+        self->next_batch = nci_target_batch_new(&cmd, 1,
+            NCI_TARGET_BATCH_FLAGS_NONE, nci_target_presence_check_batch_done,
+            nci_target_presence_check_free1, check);
+        self->presence_batch_id = self->next_batch->id;
+    } else {
+        self->presence_batch_id = 0;
+    }
+    g_bytes_unref(cmd.data);
+    return self->presence_batch_id;
+}
+
+static
+guint
+nci_target_presence_check_t3(
+    NciTarget* self,
+    NciTargetPresenceCheck* check)
+{
+    /*
+     * Check (read without encryption) of block 0, addressed to the
+     * activated IDm. Polling (SENSF_REQ) is reserved for
+     * RF_T3T_POLLING_CMD which is not available to us, and Request
+     * Response isn't supported by FeliCa Lite/Lite-S. Block 0 of the
+     * read-only NDEF service is what an NDEF-formatted Type 3 Tag has,
+     * but many FeliCa cards (e.g. transit) don't have that service.
+     * That's fine - a Check response with any status, including an
+     * error in the Status Flags, proves that the card is there. Don't
+     * require the status to be zero. The first byte is the length
+     * (including itself).
+     */
+    guint8 cmd_data[2 + T3T_IDM_SIZE + 6];
+    guint8* ptr = cmd_data;
+
+    *ptr++ = sizeof(cmd_data);
+    *ptr++ = T3T_CMD_CHECK;
+    memcpy(ptr, self->t3t_idm, T3T_IDM_SIZE);
+    ptr += T3T_IDM_SIZE;
+    *ptr++ = 1; /* Number of services */
+    *ptr++ = (guint8)T3T_SERVICE_CODE_RO; /* Little endian */
+    *ptr++ = (guint8)(T3T_SERVICE_CODE_RO >> 8);
+    *ptr++ = 1; /* Number of blocks */
+    *ptr++ = 0x80; /* 2-byte block list element, service #0 */
+    *ptr++ = 0x00; /* Block 0 */
     return nfc_target_transmit(&self->target, cmd_data, sizeof(cmd_data),
         NULL, nci_target_presence_check_complete,
         nci_target_presence_check_free1, check);
@@ -266,6 +861,20 @@ nci_target_presence_check_t4(
     NciTarget* self,
     NciTargetPresenceCheck* check)
 {
+    /*
+     * NCI 2.0 RF_ISO_DEP_NAK_PRESENCE_CMD is handled by NFCC without
+     * going through the data path, but only makes sense when there's
+     * no data exchange in progress.
+     */
+    if (!self->nak_check && !self->transmit_in_progress &&
+        nci_adapter_iso_dep_nak_presence_check(self->adapter, &self->target)) {
+        self->nak_check = check;
+        self->nak_check_timeout = g_timeout_add(NAK_PRESENCE_CHECK_TIMEOUT_MS,
+            nci_target_nak_check_timeout, self);
+        return self->nak_check_timeout;
+    }
+
+    /* Fall back to sending an empty I-block */
     return nfc_target_transmit(&self->target, NULL, 0,
         NULL, nci_target_presence_check_complete,
         nci_target_presence_check_free1, check);
@@ -274,7 +883,7 @@ nci_target_presence_check_t4(
 static
 gboolean
 nci_target_transmit_finish_frame(
-    NfcTarget* target,
+    GUtilData* data,
     const guint8* payload,
     guint len)
 {
@@ -286,8 +895,8 @@ nci_target_transmit_finish_frame(
          * 8.2.1.2 Data from RF to the DH
          */
         if (status == NCI_STATUS_OK || status == 0x14) {
-            nfc_target_transmit_done(target, NFC_TRANSMIT_STATUS_OK,
-                payload, len - 1);
+            data->bytes = payload;
+            data->size = len - 1;
             return TRUE;
         }
         GDEBUG("Transmission status 0x%02x", status);
@@ -298,7 +907,7 @@ nci_target_transmit_finish_frame(
 static
 gboolean
 nci_target_transmit_finish_iso_dep(
-    NfcTarget* target,
+    GUtilData* data,
     const guint8* payload,
     guint len)
 {
@@ -306,14 +915,15 @@ nci_target_transmit_finish_iso_dep(
      * 8.3 ISO-DEP RF Interface
      * 8.3.1.2 Data from RF to the DH
      */
-    nfc_target_transmit_done(target, NFC_TRANSMIT_STATUS_OK, payload, len);
+    data->bytes = payload;
+    data->size = len;
     return TRUE;
 }
 
 static
 gboolean
 nci_target_transmit_finish_nfc_dep(
-    NfcTarget* target,
+    GUtilData* data,
     const guint8* payload,
     guint len)
 {
@@ -321,10 +931,32 @@ nci_target_transmit_finish_nfc_dep(
      * 8.4 NFC-DEP RF Interface
      * 8.4.1.2 Data from RF to the DH
      */
-    nfc_target_transmit_done(target, NFC_TRANSMIT_STATUS_OK, payload, len);
+    data->bytes = payload;
+    data->size = len;
     return TRUE;
 }
 
+static
+gboolean
+nci_target_send_bytes(
+    NciTarget* self,
+    GBytes* bytes)
+{
+    NciAdapter* adapter = self->adapter;
+
+    /* NciCore holds a reference to the bytes until the send completes */
+    if (adapter) {
+        self->send_in_progress = nci_core_send_data_msg(adapter->nci,
+            NCI_STATIC_RF_CONN_ID, bytes, nci_target_data_sent,
+            NULL, self);
+        if (self->send_in_progress) {
+            self->transmit_in_progress = TRUE;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
 /*==========================================================================*
  * Interface
  *==========================================================================*/
@@ -365,6 +997,7 @@ nci_target_new(
         switch (ntf->protocol) {
         case NCI_PROTOCOL_T1T:
             protocol = NFC_PROTOCOL_T1_TAG;
+            presence_check = nci_target_presence_check_t1;
             break;
         case NCI_PROTOCOL_T2T:
             protocol = NFC_PROTOCOL_T2_TAG;
@@ -372,6 +1005,11 @@ nci_target_new(
             break;
         case NCI_PROTOCOL_T3T:
             protocol = NFC_PROTOCOL_T3_TAG;
+            if (tech == NFC_TECHNOLOGY_F && ntf->mode_param) {
+                presence_check = nci_target_presence_check_t3;
+            } else {
+                GDEBUG("No IDm, T3T presence check won't work");
+            }
             break;
         case NCI_PROTOCOL_ISO_DEP:
             presence_check = nci_target_presence_check_t4;
@@ -430,6 +1068,13 @@ nci_target_new(
                 NfcTarget* target = &self->target;
 
                 target->protocol = protocol;
+                if (presence_check == nci_target_presence_check_t3) {
+                    memcpy(self->t3t_idm, ntf->mode_param->poll_f.nfcid2,
+                        T3T_IDM_SIZE);
+                }
+                if (protocol == NFC_PROTOCOL_T2_TAG) {
+                    self->t2 = nci_target_t2_new(target);
+                }
                 self->adapter = adapter;
                 self->presence_check_fn = presence_check;
                 self->transmit_finish_fn = transmit_finish;
@@ -469,6 +1114,174 @@ nci_target_presence_check(
     return 0;
 }
 
+void
+nci_target_cancel_presence_check(
+    NfcTarget* target,
+    guint id)
+{
+    if (G_LIKELY(target) && id) {
+        NciTarget* self = THIS(target);
+
+        if (self->nak_check && self->nak_check_timeout == id) {
+            nci_target_cancel_nak_check(self);
+        } else if (self->presence_batch_id == id) {
+            self->presence_batch_id = 0;
+            nci_target_cancel_batch(target, id);
+        } else {
+            nfc_target_cancel_transmit(target, id);
+        }
+    }
+}
+
+void
+nci_target_iso_dep_nak_presence(
+    NfcTarget* target,
+    gboolean present)
+{
+    if (G_LIKELY(target)) {
+        NciTarget* self = THIS(target);
+
+        if (self->nak_check) {
+            nci_target_finish_nak_check(self, present);
+        } else {
+            GDEBUG("Unexpected ISO-DEP NAK presence notification");
+        }
+    }
+}
+
+gint64
+nci_target_last_transmit_ok(
+    NfcTarget* target)
+{
+    return G_LIKELY(target) ? THIS(target)->last_transmit_ok : 0;
+}
+
+/*
+ * Executes the commands back-to-back, each one is sent as soon as the
+ * response to the previous one arrives, without returning to the main
+ * loop and without involving NfcTarget queue. NfcTarget transmissions
+ * submitted in the meantime are held until the batch completes.
+ */
+guint
+nci_target_transmit_batch(
+    NfcTarget* target,
+    const NciTargetCmd* cmds,
+    guint count,
+    NCI_TARGET_BATCH_FLAGS flags,
+    NciTargetBatchFunc done,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    if (G_LIKELY(target) && G_LIKELY(count)) {
+        NciTarget* self = THIS(target);
+
+        if (self->adapter && !self->batch) {
+            NciTargetBatch* batch = nci_target_batch_new(cmds, count,
+                flags, done, destroy, user_data);
+            const guint id = batch->id;
+
+            self->batch = batch;
+            batch->after_deferred = (self->deferred != NULL);
+            if (self->transmit_in_progress || self->deferred || self->lost) {
+                GDEBUG("Batch %u is waiting", id);
+            } else if (!nci_target_batch_start(self)) {
+                /* Zero return means that destroy callback isn't invoked */
+                self->batch = NULL;
+                batch->destroy = NULL;
+                nci_target_batch_free(batch);
+                return 0;
+            }
+            return id;
+        }
+    }
+    return 0;
+}
+
+gboolean
+nci_target_reselect(
+    NfcTarget* target)
+{
+    NciTarget* self = THIS(target);
+
+    /* Brings the tag back to ACTIVE state, e.g. after T2 NACK */
+    if (self->adapter && nci_adapter_reactivate(self->adapter, target)) {
+        /* Nothing can be sent until it's back */
+        self->lost = TRUE;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+NciAdapter*
+nci_target_adapter(
+    NfcTarget* target)
+{
+    return G_LIKELY(target) ? THIS(target)->adapter : NULL;
+}
+
+/* NULL if it's not a Type 2 tag */
+NciTargetT2*
+nci_target_t2(
+    NfcTarget* target)
+{
+    return G_LIKELY(target) ? THIS(target)->t2 : NULL;
+}
+
+/*
+ * Target has left the field but may come back. Whatever is being sent
+ * at this point fails, everything else waits until the target is back
+ * or gone.
+ */
+void
+nci_target_set_lost(
+    NfcTarget* target,
+    gboolean lost)
+{
+    if (G_LIKELY(target)) {
+        NciTarget* self = THIS(target);
+
+        if (lost && !self->lost) {
+            self->lost = TRUE;
+            if (self->transmit_in_progress) {
+                self->transmit_in_progress = FALSE;
+                nci_target_cancel_send(self);
+                if (self->batch && self->batch->running) {
+                    nci_target_batch_fail_step(self,
+                        NFC_TRANSMIT_STATUS_ERROR);
+                } else {
+                    nfc_target_transmit_done(target,
+                        NFC_TRANSMIT_STATUS_ERROR, NULL, 0);
+                }
+            }
+        } else if (!lost && self->lost) {
+            self->lost = FALSE;
+            /* The tag has been power cycled */
+            nci_target_t2_reactivated(self->t2);
+            nci_target_resume(self);
+        }
+    }
+}
+
+gboolean
+nci_target_cancel_batch(
+    NfcTarget* target,
+    guint id)
+{
+    if (G_LIKELY(target) && G_LIKELY(id)) {
+        NciTarget* self = THIS(target);
+
+        if (self->batch && self->batch->id == id) {
+            nci_target_abort_batch(self, FALSE);
+            nci_target_resume(self);
+            return TRUE;
+        } else if (self->next_batch && self->next_batch->id == id) {
+            nci_target_abort_next_batch(self, FALSE);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
 /*==========================================================================*
  * Methods
  *==========================================================================*/
@@ -481,21 +1294,50 @@ nci_target_transmit(
     guint len)
 {
     NciTarget* self = THIS(target);
-    NciAdapter* adapter = self->adapter;
+
+    if ((self->batch || self->lost) && self->adapter) {
+        /* Wait for the batch to complete or for the target to reappear */
+        GASSERT(!self->deferred);
+        GDEBUG("Transmission is waiting for %s", self->lost ? "the target" :
+            "the batch");
+        self->deferred = g_bytes_new(data, len);
+        return TRUE;
+    }
 
     GASSERT(!self->send_in_progress);
     GASSERT(!self->transmit_in_progress);
-    if (adapter) {
-        GBytes* bytes = g_bytes_new(data, len);
+    if (self->adapter) {
+        GBytes* bytes;
+        gboolean ok = TRUE;
 
-        self->send_in_progress = nci_core_send_data_msg(adapter->nci,
-            NCI_STATIC_RF_CONN_ID, bytes, nci_target_data_sent,
-            NULL, self);
-        g_bytes_unref(bytes);
-        if (self->send_in_progress) {
-            self->transmit_in_progress = TRUE;
+        if (!self->cached_reply) {
+            self->cached_reply = g_byte_array_new();
+        }
+        if (nci_target_t2_cached_response(self->t2, data, len,
+            self->cached_reply)) {
+            /* NfcTarget doesn't allow completing it right away */
+            GASSERT(!self->cached_reply_id);
+            self->cached_reply_id = g_idle_add(nci_target_cached_reply, self);
             return TRUE;
         }
+
+        /*
+         * NfcTarget doesn't give us the ownership of the data and may
+         * free it as soon as the transmission gets cancelled, so this
+         * is the only copy we have to make.
+         */
+        bytes = g_bytes_new(data, len);
+        self->read_ahead_id = nci_target_t2_read_ahead(self->t2, data, len,
+            nci_target_read_ahead_done, self);
+        if (self->read_ahead_id) {
+            /* READ will be answered from the cache or sent afterwards */
+            self->read_ahead_cmd = g_bytes_ref(bytes);
+        } else {
+            nci_target_t2_cmd_sent(self->t2, data, len);
+            ok = nci_target_send_bytes(self, bytes);
+        }
+        g_bytes_unref(bytes);
+        return ok;
     }
     return FALSE;
 }
@@ -507,8 +1349,21 @@ nci_target_cancel_transmit(
 {
     NciTarget* self = THIS(target);
 
-    self->transmit_in_progress = FALSE;
-    nci_target_cancel_send(self);
+    if (self->cached_reply_id) {
+        /* It hasn't been sent at all */
+        nci_target_cancel_cached_reply(self);
+    } else if (self->read_ahead_id) {
+        /* Neither has this one */
+        nci_target_cancel_read_ahead(self);
+    } else if (self->deferred) {
+        /* It hasn't been sent yet */
+        g_bytes_unref(self->deferred);
+        self->deferred = NULL;
+    } else if (!self->batch || !self->batch->running) {
+        self->transmit_in_progress = FALSE;
+        nci_target_cancel_send(self);
+        nci_target_resume(self);
+    }
 }
 
 static
@@ -524,7 +1379,11 @@ void
 nci_target_gone(
     NfcTarget* target)
 {
-    nci_target_drop_adapter(THIS(target));
+    NciTarget* self = THIS(target);
+
+    nci_target_drop_adapter(self);
+    nci_target_abort_batch(self, TRUE);
+    nci_target_abort_next_batch(self, TRUE);
     NFC_TARGET_CLASS(PARENT_CLASS)->gone(target);
 }
 
@@ -533,9 +1392,7 @@ gboolean
 nci_target_reactivate(
     NfcTarget* target)
 {
-    NciTarget* self = THIS(target);
-
-    return self->adapter && nci_adapter_reactivate(self->adapter, target);
+    return nci_target_reselect(target);
 }
 
 /*==========================================================================*
@@ -554,7 +1411,22 @@ void
 nci_target_finalize(
     GObject* object)
 {
-    nci_target_drop_adapter(THIS(object));
+    NciTarget* self = THIS(object);
+
+    nci_target_drop_adapter(self);
+    nci_target_t2_free(self->t2);
+    nci_target_abort_batch(self, FALSE);
+    nci_target_abort_next_batch(self, FALSE);
+    if (self->early_reply_count) {
+        GDEBUG("%u out of %u replies arrived before send completion",
+            self->early_reply_count, self->reply_count);
+    }
+    if (self->reply_buf) {
+        g_byte_array_free(self->reply_buf, TRUE);
+    }
+    if (self->cached_reply) {
+        g_byte_array_free(self->cached_reply, TRUE);
+    }
     G_OBJECT_CLASS(PARENT_CLASS)->finalize(object);
 }
 
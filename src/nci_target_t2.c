@@ -0,0 +1,1238 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "nci_plugin_p.h"
+#include "nci_plugin_log.h"
+
+#define T2T_CMD_READ (0x30)
+#define T2T_CMD_GET_VERSION (0x60)
+#define T2T_CMD_FAST_READ (0x3a)
+#define T2T_CMD_READ_CNT (0x39)
+#define T2T_CMD_READ_SIG (0x3c)
+#define T2T_CMD_WRITE (0xa2)
+#define T2T_CMD_COMPATIBILITY_WRITE (0xa0)
+#define T2T_CMD_SECTOR_SELECT (0xc2)
+#define T2T_ACK (0x0a)
+#define T2T_ACK_MASK (0x0f)
+
+#define T2T_PAGE_SIZE (4)
+#define T2T_READ_PAGES (4)
+#define T2T_SECTOR_PAGES (256)
+#define T2T_FAST_READ_MAX_PAGES (32) /* Keeps the frame below 256 bytes */
+#define T2T_READ_AHEAD_PAGES (64)
+
+#define T2T_CC_PAGE (3)
+#define T2T_CC_MAGIC (0xe1)
+#define T2T_DATA_PAGE (4)
+#define T2T_MIN_PAGES (16) /* Even the smallest tags have that many */
+#define T2T_SMALL_DATA_SIZE (64) /* FAST_READ wouldn't save much */
+
+#define T2T_VERSION_SIZE (8)
+#define T2T_VERSION_VENDOR_NXP (0x04)
+#define T2T_VERSION_TYPE_ULTRALIGHT (0x03)
+#define T2T_VERSION_TYPE_NTAG (0x04)
+
+#define SECTOR_UNKNOWN G_MAXUINT
+
+typedef enum nci_target_t2_version {
+    T2_VERSION_UNKNOWN,
+    T2_VERSION_PENDING,
+    T2_VERSION_KNOWN
+} NCI_TARGET_T2_VERSION;
+
+typedef struct nci_target_t2_read {
+    guint id;
+    guint next_page;
+    guint end_page;
+    GByteArray* data;
+    NciTargetT2ReadFunc done;
+    GDestroyNotify destroy;
+    void* user_data;
+    gboolean starting; /* Inside nci_target_t2_read() */
+    guint complete_id; /* Completing from the cache */
+    /* Current batch */
+    guint batch_id;
+    guint batch_select; /* Number of SECTOR_SELECT commands */
+    guint batch_first_page;
+    guint batch_end_page;
+    guint batch_step; /* Pages per command */
+} NciTargetT2Read;
+
+typedef struct nci_target_t2_write {
+    guint id;
+    guint first_page;
+    guint next_page;
+    guint end_page;
+    guint8* data;
+    guint8* prev; /* Optional */
+    guint written;
+    NciTargetT2WriteFunc done;
+    GDestroyNotify destroy;
+    void* user_data;
+    gboolean starting; /* Inside nci_target_t2_write() */
+    guint complete_id; /* Nothing to write */
+    /* Current batch */
+    guint batch_id;
+    guint batch_select; /* Number of SECTOR_SELECT commands */
+    GArray* batch_pages; /* Pages being written */
+} NciTargetT2Write;
+
+/* Page cache is allocated sector by sector, when needed */
+typedef struct nci_target_t2_sector {
+    guint8 valid[T2T_SECTOR_PAGES / 8];
+    guint8 data[T2T_SECTOR_PAGES * T2T_PAGE_SIZE];
+} NciTargetT2Sector;
+
+struct nci_target_t2 {
+    NfcTarget* target;
+    NCI_TARGET_T2_VERSION version;
+    gboolean fast_read;
+    guint sector;
+    NciTargetT2Read* read;
+    NciTargetT2Write* write;
+    GPtrArray* cache; /* NciTargetT2Sector* indexed by sector */
+    guint cmd_page; /* Page being read by NfcTarget transmission */
+    guint cmd_pages; /* Zero if it's not a read */
+    gboolean cmd_wraps; /* READ wraps around at the end of memory */
+};
+
+/*==========================================================================*
+ * Page cache
+ *==========================================================================*/
+
+static
+NciTargetT2Sector*
+nci_target_t2_cache_sector(
+    NciTargetT2* self,
+    guint sector,
+    gboolean create)
+{
+    GPtrArray* cache = self->cache;
+
+    if (cache && sector < cache->len && cache->pdata[sector]) {
+        return cache->pdata[sector];
+    } else if (create) {
+        NciTargetT2Sector* s = g_slice_new0(NciTargetT2Sector);
+
+        if (!cache) {
+            cache = self->cache = g_ptr_array_new();
+        }
+        if (sector >= cache->len) {
+            g_ptr_array_set_size(cache, sector + 1);
+        }
+        cache->pdata[sector] = s;
+        return s;
+    }
+    return NULL;
+}
+
+static
+const guint8*
+nci_target_t2_cache_get(
+    NciTargetT2* self,
+    guint page,
+    guint count)
+{
+    const guint sector = page / T2T_SECTOR_PAGES;
+    const guint first = page % T2T_SECTOR_PAGES;
+    NciTargetT2Sector* s = nci_target_t2_cache_sector(self, sector, FALSE);
+
+    /* All pages have to be in the same sector */
+    if (s && count && (first + count) <= T2T_SECTOR_PAGES) {
+        guint i;
+
+        for (i = first; i < first + count; i++) {
+            if (!(s->valid[i / 8] & (1 << (i % 8)))) {
+                return NULL;
+            }
+        }
+        return s->data + first * T2T_PAGE_SIZE;
+    }
+    return NULL;
+}
+
+static
+void
+nci_target_t2_cache_put(
+    NciTargetT2* self,
+    guint page,
+    const guint8* data,
+    guint count)
+{
+    const guint sector = page / T2T_SECTOR_PAGES;
+    const guint first = page % T2T_SECTOR_PAGES;
+    const guint n = MIN(count, T2T_SECTOR_PAGES - first);
+    NciTargetT2Sector* s = nci_target_t2_cache_sector(self, sector, TRUE);
+    guint i;
+
+    memcpy(s->data + first * T2T_PAGE_SIZE, data, n * T2T_PAGE_SIZE);
+    for (i = first; i < first + n; i++) {
+        s->valid[i / 8] |= (1 << (i % 8));
+    }
+}
+
+static
+guint
+nci_target_t2_known_pages(
+    NciTargetT2* self)
+{
+    const guint8* cc = nci_target_t2_cache_get(self, T2T_CC_PAGE, 1);
+
+    /* Pages which definitely exist in sector 0 */
+    if (cc && cc[0] == T2T_CC_MAGIC) {
+        return MIN(MAX(T2T_DATA_PAGE + cc[2] * 8 / T2T_PAGE_SIZE,
+            T2T_MIN_PAGES), T2T_SECTOR_PAGES);
+    }
+    return T2T_MIN_PAGES;
+}
+
+static
+void
+nci_target_t2_cache_invalidate(
+    NciTargetT2* self,
+    guint page)
+{
+    NciTargetT2Sector* s = nci_target_t2_cache_sector(self,
+        page / T2T_SECTOR_PAGES, FALSE);
+
+    if (s) {
+        const guint i = page % T2T_SECTOR_PAGES;
+
+        s->valid[i / 8] &= ~(1 << (i % 8));
+    }
+}
+
+static
+void
+nci_target_t2_cache_flush(
+    NciTargetT2* self)
+{
+    GPtrArray* cache = self->cache;
+
+    if (cache) {
+        guint i;
+
+        for (i = 0; i < cache->len; i++) {
+            if (cache->pdata[i]) {
+                g_slice_free(NciTargetT2Sector, cache->pdata[i]);
+            }
+        }
+        g_ptr_array_free(cache, TRUE);
+        self->cache = NULL;
+    }
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+static
+guint
+nci_target_t2_next_id(void)
+{
+    static guint nci_target_t2_last_id = 0;
+    guint id = ++nci_target_t2_last_id;
+
+    /* Zero id is reserved */
+    if (!id) {
+        id = ++nci_target_t2_last_id;
+    }
+    return id;
+}
+
+static
+void
+nci_target_t2_read_next(
+    NciTargetT2* self);
+
+static
+gboolean
+nci_target_t2_check_ack(
+    const GUtilData* response)
+{
+    return response->size == 1 &&
+        (response->bytes[0] & T2T_ACK_MASK) == T2T_ACK;
+}
+
+static
+gboolean
+nci_target_t2_check_read(
+    const GUtilData* response)
+{
+    return response->size == T2T_READ_PAGES * T2T_PAGE_SIZE;
+}
+
+static
+gboolean
+nci_target_t2_check_fast_read(
+    const GUtilData* response)
+{
+    /* The exact size is checked when the results get collected */
+    return response->size && !(response->size % T2T_PAGE_SIZE);
+}
+
+static
+gboolean
+nci_target_t2_check_version(
+    const GUtilData* response)
+{
+    return response->size == T2T_VERSION_SIZE;
+}
+
+static
+guint
+nci_target_t2_add_sector_select(
+    NciTargetCmd* cmds,
+    guint sector)
+{
+    /* Packet 2 is acknowledged by not responding */
+    static const guint8 pkt1[] = { T2T_CMD_SECTOR_SELECT, 0xff };
+    guint8 pkt2[4];
+
+    memset(pkt2, 0, sizeof(pkt2));
+    pkt2[0] = (guint8)sector;
+    memset(cmds, 0, 2 * sizeof(cmds[0]));
+    cmds[0].data = g_bytes_new_static(pkt1, sizeof(pkt1));
+    cmds[0].check = nci_target_t2_check_ack;
+    cmds[1].data = g_bytes_new(pkt2, sizeof(pkt2));
+    cmds[1].passive_ack = TRUE;
+    return 2;
+}
+
+static
+void
+nci_target_t2_free_cmds(
+    NciTargetCmd* cmds,
+    guint count)
+{
+    guint i;
+
+    for (i = 0; i < count; i++) {
+        g_bytes_unref(cmds[i].data);
+    }
+    g_free(cmds);
+}
+
+static
+guint
+nci_target_t2_restore_sector(
+    NciTargetT2* self,
+    NciTargetBatchFunc done)
+{
+    /* Leave the tag in sector 0, that's what everyone expects */
+    NciTargetCmd* cmds = g_new0(NciTargetCmd, 2);
+    const guint n = nci_target_t2_add_sector_select(cmds, 0);
+    const guint id = nci_target_transmit_batch(self->target, cmds, n,
+        NCI_TARGET_BATCH_STOP_ON_ERROR, done, NULL, self);
+
+    nci_target_t2_free_cmds(cmds, n);
+    return id;
+}
+
+/*==========================================================================*
+ * Reader
+ *==========================================================================*/
+
+static
+void
+nci_target_t2_read_free(
+    NciTargetT2Read* read)
+{
+    if (read->complete_id) {
+        g_source_remove(read->complete_id);
+    }
+    if (read->destroy) {
+        read->destroy(read->user_data);
+    }
+    g_byte_array_free(read->data, TRUE);
+    g_slice_free(NciTargetT2Read, read);
+}
+
+static
+void
+nci_target_t2_read_finish(
+    NciTargetT2* self,
+    gboolean ok)
+{
+    NciTargetT2Read* read = self->read;
+
+    self->read = NULL;
+    if (read->starting) {
+        /* Zero return means that the callbacks aren't invoked */
+        read->done = NULL;
+        read->destroy = NULL;
+    } else if (read->done) {
+        GUtilData data;
+
+        data.bytes = read->data->data;
+        data.size = read->data->len;
+        read->done(self->target, ok ? &data : NULL, read->user_data);
+    }
+    nci_target_t2_read_free(read);
+}
+
+static
+gboolean
+nci_target_t2_read_complete(
+    gpointer user_data)
+{
+    NciTargetT2* self = user_data;
+
+    self->read->complete_id = 0;
+    nci_target_t2_read_finish(self, TRUE);
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+nci_target_t2_version_done(
+    NfcTarget* target,
+    const NciTargetBatchResult* results,
+    guint count,
+    void* user_data)
+{
+    NciTargetT2* self = user_data;
+    const NciTargetBatchResult* result = results;
+
+    self->version = T2_VERSION_KNOWN;
+    if (count == 1 && result->status == NFC_TRANSMIT_STATUS_OK &&
+        result->expected) {
+        const guint8* version = result->data.bytes;
+
+        /* Byte 0 is a fixed header, then vendor and product type */
+        self->fast_read = version[1] == T2T_VERSION_VENDOR_NXP &&
+            (version[2] == T2T_VERSION_TYPE_ULTRALIGHT ||
+             version[2] == T2T_VERSION_TYPE_NTAG);
+        GDEBUG("T2 version %02x%02x%02x%02x%02x%02x%02x%02x, %s FAST_READ",
+            version[0], version[1], version[2], version[3], version[4],
+            version[5], version[6], version[7], self->fast_read ?
+            "using" : "no");
+        if (self->read) {
+            nci_target_t2_read_next(self);
+        }
+    } else {
+        /*
+         * Tags which don't support GET_VERSION respond with NACK and
+         * fall back to IDLE state. Wake it up and carry on with READ,
+         * the batch waits until the tag is back.
+         */
+        GDEBUG("No GET_VERSION, using READ");
+        self->fast_read = FALSE;
+        nci_adapter_t2_set_no_version(nci_target_adapter(target));
+        if (nci_target_reselect(target)) {
+            if (self->read) {
+                nci_target_t2_read_next(self);
+            }
+        } else if (self->read) {
+            nci_target_t2_read_finish(self, FALSE);
+        }
+    }
+}
+
+static
+void
+nci_target_t2_batch_done(
+    NfcTarget* target,
+    const NciTargetBatchResult* results,
+    guint count,
+    void* user_data)
+{
+    NciTargetT2* self = user_data;
+    NciTargetT2Read* read = self->read;
+    const guint nsel = read->batch_select;
+    gboolean ok = TRUE;
+    guint i, page;
+
+    read->batch_id = 0;
+    for (i = 0; i < count && ok; i++) {
+        const NciTargetBatchResult* result = results + i;
+
+        ok = (result->status == NFC_TRANSMIT_STATUS_OK && result->expected);
+    }
+    /* Collect the data */
+    for (i = nsel, page = read->batch_first_page;
+         ok && page < read->batch_end_page;
+         i++, page += read->batch_step) {
+        const guint n = MIN(read->batch_step, read->batch_end_page - page);
+        const guint size = n * T2T_PAGE_SIZE;
+
+        if (i < count && results[i].data.size >= size) {
+            g_byte_array_append(read->data, results[i].data.bytes, size);
+            nci_target_t2_cache_put(self, page, results[i].data.bytes, n);
+        } else {
+            ok = FALSE;
+        }
+    }
+
+    if (ok) {
+        if (nsel) {
+            self->sector = read->batch_first_page / T2T_SECTOR_PAGES;
+        }
+        read->next_page = read->batch_end_page;
+        nci_target_t2_read_next(self);
+    } else {
+        GDEBUG("T2 read failed at page %u", read->batch_first_page);
+        if (nsel) {
+            self->sector = SECTOR_UNKNOWN;
+        }
+        nci_target_t2_read_finish(self, FALSE);
+    }
+}
+
+static
+void
+nci_target_t2_restore_done(
+    NfcTarget* target,
+    const NciTargetBatchResult* results,
+    guint count,
+    void* user_data)
+{
+    NciTargetT2* self = user_data;
+    NciTargetT2Read* read = self->read;
+    const gboolean ok = (count == 2 && results[1].expected);
+
+    read->batch_id = 0;
+    self->sector = ok ? 0 : SECTOR_UNKNOWN;
+    nci_target_t2_read_finish(self, ok);
+}
+
+static
+gboolean
+nci_target_t2_need_version(
+    NciTargetT2* self)
+{
+    if (self->version == T2_VERSION_UNKNOWN) {
+        const guint8* cc = nci_target_t2_cache_get(self, T2T_CC_PAGE, 1);
+
+        /*
+         * GET_VERSION costs a reactivation if the tag doesn't support
+         * it (Ultralight, NTAG203 and such). Only ask larger tags, and
+         * only once per tag. Until the CC is known, stick to READ.
+         */
+        if (cc && cc[0] == T2T_CC_MAGIC) {
+            if (cc[2] * 8 > T2T_SMALL_DATA_SIZE &&
+                !nci_adapter_t2_no_version(nci_target_adapter(self->target))) {
+                return TRUE;
+            }
+            self->version = T2_VERSION_KNOWN;
+            self->fast_read = FALSE;
+        }
+    }
+    return FALSE;
+}
+
+static
+void
+nci_target_t2_read_next(
+    NciTargetT2* self)
+{
+    NciTargetT2Read* read = self->read;
+
+    if (nci_target_t2_need_version(self)) {
+        static const guint8 get_version[] = { T2T_CMD_GET_VERSION };
+        NciTargetCmd cmd;
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.data = g_bytes_new_static(get_version, sizeof(get_version));
+        cmd.check = nci_target_t2_check_version;
+        self->version = T2_VERSION_PENDING;
+        read->batch_id = nci_target_transmit_batch(self->target, &cmd, 1,
+            NCI_TARGET_BATCH_FLAGS_NONE, nci_target_t2_version_done,
+            NULL, self);
+        g_bytes_unref(cmd.data);
+        if (!read->batch_id) {
+            self->version = T2_VERSION_UNKNOWN;
+            nci_target_t2_read_finish(self, FALSE);
+        }
+    } else if (read->next_page < read->end_page &&
+        nci_target_t2_cache_get(self, read->next_page, 1)) {
+        /* Take whatever we already have from the cache */
+        do {
+            g_byte_array_append(read->data, nci_target_t2_cache_get(self,
+                read->next_page, 1), T2T_PAGE_SIZE);
+            read->next_page++;
+        } while (read->next_page < read->end_page &&
+            nci_target_t2_cache_get(self, read->next_page, 1));
+        nci_target_t2_read_next(self);
+    } else if (read->next_page < read->end_page) {
+        const guint first = read->next_page;
+        const guint sector = first / T2T_SECTOR_PAGES;
+        const guint end = MIN(read->end_page, (sector + 1) * T2T_SECTOR_PAGES);
+        const guint step = self->fast_read ? T2T_FAST_READ_MAX_PAGES :
+            T2T_READ_PAGES;
+        const guint max = 2 + (end - first + step - 1) / step;
+        NciTargetCmd* cmds = g_new0(NciTargetCmd, max);
+        guint n = 0, page;
+
+        /* Each batch covers one sector */
+        read->batch_select = 0;
+        if (sector != self->sector) {
+            n += read->batch_select = nci_target_t2_add_sector_select(cmds,
+                sector);
+        }
+        for (page = first; page < end; page += step) {
+            NciTargetCmd* cmd = cmds + (n++);
+            const guint8 start = (guint8)(page % T2T_SECTOR_PAGES);
+
+            if (self->fast_read) {
+                const guint8 last = start + MIN(step, end - page) - 1;
+                guint8 fast_read[3];
+
+                fast_read[0] = T2T_CMD_FAST_READ;
+                fast_read[1] = start;
+                fast_read[2] = last;
+                cmd->data = g_bytes_new(fast_read, sizeof(fast_read));
+                cmd->check = nci_target_t2_check_fast_read;
+            } else {
+                guint8 read_cmd[2];
+
+                read_cmd[0] = T2T_CMD_READ;
+                read_cmd[1] = start;
+                cmd->data = g_bytes_new(read_cmd, sizeof(read_cmd));
+                cmd->check = nci_target_t2_check_read;
+            }
+        }
+
+        read->batch_first_page = first;
+        read->batch_end_page = end;
+        read->batch_step = step;
+        read->batch_id = nci_target_transmit_batch(self->target, cmds, n,
+            NCI_TARGET_BATCH_STOP_ON_ERROR, nci_target_t2_batch_done,
+            NULL, self);
+        nci_target_t2_free_cmds(cmds, n);
+        if (!read->batch_id) {
+            nci_target_t2_read_finish(self, FALSE);
+        }
+    } else if (self->sector) {
+        read->batch_id = nci_target_t2_restore_sector(self,
+            nci_target_t2_restore_done);
+        if (!read->batch_id) {
+            nci_target_t2_read_finish(self, FALSE);
+        }
+    } else if (read->starting) {
+        /* Everything came from the cache, don't complete synchronously */
+        read->complete_id = g_idle_add(nci_target_t2_read_complete, self);
+    } else {
+        nci_target_t2_read_finish(self, TRUE);
+    }
+}
+
+/*==========================================================================*
+ * Writer
+ *==========================================================================*/
+
+static
+void
+nci_target_t2_write_next(
+    NciTargetT2* self);
+
+static
+void
+nci_target_t2_write_free(
+    NciTargetT2Write* write)
+{
+    if (write->complete_id) {
+        g_source_remove(write->complete_id);
+    }
+    if (write->destroy) {
+        write->destroy(write->user_data);
+    }
+    g_array_free(write->batch_pages, TRUE);
+    g_free(write->data);
+    g_free(write->prev);
+    g_slice_free(NciTargetT2Write, write);
+}
+
+static
+void
+nci_target_t2_write_finish(
+    NciTargetT2* self,
+    gboolean ok)
+{
+    NciTargetT2Write* write = self->write;
+
+    self->write = NULL;
+    if (write->done) {
+        write->done(self->target, ok, write->written, write->user_data);
+    }
+    nci_target_t2_write_free(write);
+}
+
+static
+gboolean
+nci_target_t2_write_complete(
+    gpointer user_data)
+{
+    NciTargetT2* self = user_data;
+
+    self->write->complete_id = 0;
+    nci_target_t2_write_finish(self, TRUE);
+    return G_SOURCE_REMOVE;
+}
+
+static
+const guint8*
+nci_target_t2_write_page_data(
+    NciTargetT2Write* write,
+    guint page)
+{
+    return write->data + (page - write->first_page) * T2T_PAGE_SIZE;
+}
+
+static
+gboolean
+nci_target_t2_write_page_dirty(
+    NciTargetT2* self,
+    guint page)
+{
+    NciTargetT2Write* write = self->write;
+    const guint offset = (page - write->first_page) * T2T_PAGE_SIZE;
+    const guint8* data = write->data + offset;
+    const guint8* cached = nci_target_t2_cache_get(self, page, 1);
+
+    return !(write->prev && !memcmp(write->prev + offset, data,
+        T2T_PAGE_SIZE)) && !(cached && !memcmp(cached, data, T2T_PAGE_SIZE));
+}
+
+static
+void
+nci_target_t2_write_invalidate_batch(
+    NciTargetT2* self,
+    guint from)
+{
+    NciTargetT2Write* write = self->write;
+    GArray* pages = write->batch_pages;
+    guint i;
+
+    /* We don't know what happened to these */
+    for (i = from; i < pages->len; i++) {
+        nci_target_t2_cache_invalidate(self, g_array_index(pages, guint, i));
+    }
+    g_array_set_size(pages, 0);
+}
+
+static
+void
+nci_target_t2_write_batch_done(
+    NfcTarget* target,
+    const NciTargetBatchResult* results,
+    guint count,
+    void* user_data)
+{
+    NciTargetT2* self = user_data;
+    NciTargetT2Write* write = self->write;
+    GArray* pages = write->batch_pages;
+    const guint nsel = write->batch_select;
+    gboolean ok = TRUE;
+    gboolean nack = FALSE;
+    guint i;
+
+    write->batch_id = 0;
+    for (i = 0; i < count && ok; i++) {
+        const NciTargetBatchResult* result = results + i;
+
+        ok = (result->status == NFC_TRANSMIT_STATUS_OK && result->expected);
+        nack = (result->status == NFC_TRANSMIT_STATUS_OK && !ok);
+    }
+    if (count < nsel + pages->len) {
+        ok = FALSE;
+    }
+
+    /* Update the cache with what has been acknowledged */
+    for (i = 0; i < pages->len && (nsel + i) < count; i++) {
+        const NciTargetBatchResult* result = results + nsel + i;
+        const guint page = g_array_index(pages, guint, i);
+
+        if (result->status == NFC_TRANSMIT_STATUS_OK && result->expected) {
+            nci_target_t2_cache_put(self, page,
+                nci_target_t2_write_page_data(write, page), 1);
+            write->written++;
+        } else {
+            break;
+        }
+    }
+
+    if (ok) {
+        const guint last = g_array_index(pages, guint, pages->len - 1);
+
+        if (nsel) {
+            self->sector = last / T2T_SECTOR_PAGES;
+        }
+        g_array_set_size(pages, 0);
+        write->next_page = last + 1;
+        nci_target_t2_write_next(self);
+    } else {
+        GDEBUG("T2 write failed at page %u", (i < pages->len) ?
+            g_array_index(pages, guint, i) : write->next_page);
+        nci_target_t2_write_invalidate_batch(self, i);
+        if (nsel) {
+            self->sector = SECTOR_UNKNOWN;
+        }
+        if (nack) {
+            /* NACK puts the tag into IDLE state */
+            self->sector = SECTOR_UNKNOWN;
+            nci_target_reselect(target);
+        }
+        nci_target_t2_write_finish(self, FALSE);
+    }
+}
+
+static
+void
+nci_target_t2_write_restore_done(
+    NfcTarget* target,
+    const NciTargetBatchResult* results,
+    guint count,
+    void* user_data)
+{
+    NciTargetT2* self = user_data;
+    NciTargetT2Write* write = self->write;
+    const gboolean ok = (count == 2 && results[1].expected);
+
+    write->batch_id = 0;
+    self->sector = ok ? 0 : SECTOR_UNKNOWN;
+    nci_target_t2_write_finish(self, ok);
+}
+
+static
+void
+nci_target_t2_write_next(
+    NciTargetT2* self)
+{
+    NciTargetT2Write* write = self->write;
+
+    /* Skip the pages which are already there */
+    while (write->next_page < write->end_page &&
+        !nci_target_t2_write_page_dirty(self, write->next_page)) {
+        write->next_page++;
+    }
+
+    if (write->next_page < write->end_page) {
+        GArray* pages = write->batch_pages;
+        const guint first = write->next_page;
+        const guint sector = first / T2T_SECTOR_PAGES;
+        const guint end = MIN(write->end_page,
+            (sector + 1) * T2T_SECTOR_PAGES);
+        NciTargetCmd* cmds;
+        guint page, i, n = 0;
+
+        /* Collect the dirty pages in this sector */
+        for (page = first; page < end; page++) {
+            if (nci_target_t2_write_page_dirty(self, page)) {
+                g_array_append_val(pages, page);
+            }
+        }
+
+        /* Each batch covers one sector */
+        cmds = g_new0(NciTargetCmd, pages->len + 2);
+        write->batch_select = 0;
+        if (sector != self->sector) {
+            n += write->batch_select = nci_target_t2_add_sector_select(cmds,
+                sector);
+        }
+        for (i = 0; i < pages->len; i++) {
+            NciTargetCmd* cmd = cmds + (n++);
+            const guint p = g_array_index(pages, guint, i);
+            guint8 write_cmd[2 + T2T_PAGE_SIZE];
+
+            write_cmd[0] = T2T_CMD_WRITE;
+            write_cmd[1] = (guint8)(p % T2T_SECTOR_PAGES);
+            memcpy(write_cmd + 2, nci_target_t2_write_page_data(write, p),
+                T2T_PAGE_SIZE);
+            cmd->data = g_bytes_new(write_cmd, sizeof(write_cmd));
+            cmd->check = nci_target_t2_check_ack;
+        }
+
+        GDEBUG("Writing %u page(s) in sector %u", pages->len, sector);
+        write->batch_id = nci_target_transmit_batch(self->target, cmds, n,
+            NCI_TARGET_BATCH_STOP_ON_ERROR, nci_target_t2_write_batch_done,
+            NULL, self);
+        nci_target_t2_free_cmds(cmds, n);
+        if (!write->batch_id) {
+            g_array_set_size(pages, 0);
+            nci_target_t2_write_finish(self, FALSE);
+        }
+    } else if (self->sector) {
+        write->batch_id = nci_target_t2_restore_sector(self,
+            nci_target_t2_write_restore_done);
+        if (!write->batch_id) {
+            nci_target_t2_write_finish(self, FALSE);
+        }
+    } else if (write->starting) {
+        /* Nothing has changed, don't complete synchronously */
+        write->complete_id = g_idle_add(nci_target_t2_write_complete, self);
+    } else {
+        nci_target_t2_write_finish(self, TRUE);
+    }
+}
+
+/*==========================================================================*
+ * Internal interface
+ *==========================================================================*/
+
+NciTargetT2*
+nci_target_t2_new(
+    NfcTarget* target)
+{
+    NciTargetT2* self = g_slice_new0(NciTargetT2);
+
+    /* Not a reference, NciTarget owns us */
+    self->target = target;
+    return self;
+}
+
+void
+nci_target_t2_free(
+    NciTargetT2* self)
+{
+    if (self) {
+        nci_target_t2_cancel_read(self, self->read ? self->read->id : 0);
+        nci_target_t2_cancel_write(self, self->write ? self->write->id : 0);
+        nci_target_t2_cache_flush(self);
+        g_slice_free(NciTargetT2, self);
+    }
+}
+
+/*
+ * Tag has been reactivated and is back in sector 0. Memory contents
+ * are supposed to be the same, so the cache is kept.
+ */
+void
+nci_target_t2_reactivated(
+    NciTargetT2* self)
+{
+    if (self) {
+        self->sector = 0;
+    }
+}
+
+/*
+ * Answers NfcTarget READ or FAST_READ from the page cache. Returns TRUE
+ * and fills the response if all requested pages are there.
+ */
+gboolean
+nci_target_t2_cached_response(
+    NciTargetT2* self,
+    const void* data,
+    guint len,
+    GByteArray* response)
+{
+    const guint8* cmd = data;
+
+    /* NfcTarget transmissions address the currently selected sector */
+    if (self && len > 1 && self->sector != SECTOR_UNKNOWN) {
+        const guint base = self->sector * T2T_SECTOR_PAGES;
+        const guint8* pages = NULL;
+        guint n = 0;
+
+        if (cmd[0] == T2T_CMD_READ && len == 2) {
+            /* READ always returns 4 pages */
+            n = T2T_READ_PAGES;
+        } else if (cmd[0] == T2T_CMD_FAST_READ && len == 3 &&
+            cmd[2] >= cmd[1]) {
+            n = cmd[2] - cmd[1] + 1;
+        }
+        if (n) {
+            pages = nci_target_t2_cache_get(self, base + cmd[1], n);
+        }
+        if (pages) {
+            GDEBUG("T2 page cache hit, %u page(s) at %u", n, cmd[1]);
+            g_byte_array_set_size(response, 0);
+            g_byte_array_append(response, pages, n * T2T_PAGE_SIZE);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Called before NfcTarget transmission is sent to the tag. Remembers
+ * which pages are being read and invalidates the pages being written.
+ * Anything unknown flushes the whole cache, it may change the memory
+ * in ways we don't understand.
+ */
+void
+nci_target_t2_cmd_sent(
+    NciTargetT2* self,
+    const void* data,
+    guint len)
+{
+    const guint8* cmd = data;
+
+    if (self && len) {
+        const guint base = (self->sector == SECTOR_UNKNOWN) ? 0 :
+            (self->sector * T2T_SECTOR_PAGES);
+
+        self->cmd_pages = 0;
+        switch (cmd[0]) {
+        case T2T_CMD_READ:
+            if (len == 2 && self->sector != SECTOR_UNKNOWN) {
+                self->cmd_page = base + cmd[1];
+                self->cmd_pages = T2T_READ_PAGES;
+                self->cmd_wraps = TRUE;
+            }
+            return;
+        case T2T_CMD_FAST_READ:
+            if (len == 3 && cmd[2] >= cmd[1] &&
+                self->sector != SECTOR_UNKNOWN) {
+                self->cmd_page = base + cmd[1];
+                self->cmd_pages = cmd[2] - cmd[1] + 1;
+                self->cmd_wraps = FALSE;
+            }
+            return;
+        case T2T_CMD_GET_VERSION:
+        case T2T_CMD_READ_CNT:
+        case T2T_CMD_READ_SIG:
+            return;
+        case T2T_CMD_WRITE:
+        case T2T_CMD_COMPATIBILITY_WRITE:
+            if (len >= 2 && self->sector != SECTOR_UNKNOWN) {
+                nci_target_t2_cache_invalidate(self, base + cmd[1]);
+                return;
+            }
+            break;
+        case T2T_CMD_SECTOR_SELECT:
+            /* We don't know whether it's going to succeed */
+            self->sector = SECTOR_UNKNOWN;
+            return;
+        }
+        GDEBUG("Flushing T2 page cache");
+        nci_target_t2_cache_flush(self);
+    }
+}
+
+/*
+ * Called when NfcTarget transmission completes, response is NULL
+ * if it has failed.
+ */
+void
+nci_target_t2_cmd_done(
+    NciTargetT2* self,
+    const GUtilData* response)
+{
+    if (self && self->cmd_pages) {
+        guint n = self->cmd_pages;
+
+        self->cmd_pages = 0;
+        if (self->cmd_wraps) {
+            /*
+             * READ near the end of memory rolls over to page 0. Since
+             * the memory size is generally unknown, only cache the
+             * pages which are known to exist.
+             */
+            const guint end = (self->cmd_page < T2T_SECTOR_PAGES) ?
+                nci_target_t2_known_pages(self) : 0;
+
+            n = (self->cmd_page < end) ? MIN(n, end - self->cmd_page) : 0;
+        }
+        if (n && response && response->size >= n * T2T_PAGE_SIZE) {
+            nci_target_t2_cache_put(self, self->cmd_page, response->bytes, n);
+        }
+    }
+}
+
+/*
+ * Reads count pages starting with the given one. Pages are numbered
+ * across sectors (sector * 256 + page), crossing sector boundary
+ * requires SECTOR_SELECT support. Only one read can be active at
+ * a time. The range must exist, otherwise the tag responds with
+ * NACK and goes to IDLE state. Zero return means that the callbacks
+ * won't be invoked.
+ */
+guint
+nci_target_t2_read(
+    NciTargetT2* self,
+    guint page,
+    guint count,
+    NciTargetT2ReadFunc done,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    if (self && count && !self->read && !self->write) {
+        NciTargetT2Read* read = g_slice_new0(NciTargetT2Read);
+        const guint id = nci_target_t2_next_id();
+
+        read->id = id;
+        read->next_page = page;
+        read->end_page = page + count;
+        read->data = g_byte_array_sized_new(count * T2T_PAGE_SIZE);
+        read->done = done;
+        read->destroy = destroy;
+        read->user_data = user_data;
+        self->read = read;
+        read->starting = TRUE;
+        nci_target_t2_read_next(self);
+        if (self->read == read) {
+            read->starting = FALSE;
+        }
+
+        /* The read may have already failed */
+        return (self->read && self->read->id == id) ? id : 0;
+    }
+    return 0;
+}
+
+/*
+ * If NfcTarget READ addresses the data area described by the Capability
+ * Container, reads the following pages in one go (with FAST_READ if the
+ * tag supports it) so that this and the next READs are answered from
+ * the page cache. Returns zero if it doesn't make sense.
+ */
+guint
+nci_target_t2_read_ahead(
+    NciTargetT2* self,
+    const void* data,
+    guint len,
+    NciTargetT2ReadFunc done,
+    void* user_data)
+{
+    const guint8* cmd = data;
+
+    if (self && len == 2 && cmd[0] == T2T_CMD_READ && !self->sector &&
+        !self->read && !self->write) {
+        const guint8* cc = nci_target_t2_cache_get(self, T2T_CC_PAGE, 1);
+
+        if (cc && cc[0] == T2T_CC_MAGIC) {
+            /* CC byte 2 is the data area size divided by 8 */
+            const guint end = nci_target_t2_known_pages(self);
+            const guint page = cmd[1];
+
+            if (page >= T2T_DATA_PAGE && page + T2T_READ_PAGES <= end) {
+                const guint count = MIN(end - page, T2T_READ_AHEAD_PAGES);
+
+                GDEBUG("T2 read ahead, %u page(s) at %u", count, page);
+                return nci_target_t2_read(self, page, count, done, NULL,
+                    user_data);
+            }
+        }
+    }
+    return 0;
+}
+
+void
+nci_target_t2_cancel_read(
+    NciTargetT2* self,
+    guint id)
+{
+    if (self && id && self->read && self->read->id == id) {
+        NciTargetT2Read* read = self->read;
+
+        self->read = NULL;
+        if (read->batch_id) {
+            if (self->version == T2_VERSION_PENDING) {
+                self->version = T2_VERSION_UNKNOWN;
+            }
+            nci_target_cancel_batch(self->target, read->batch_id);
+        }
+        nci_target_t2_read_free(read);
+    }
+}
+
+/*
+ * Writes the memory image starting at the given page, skipping pages
+ * which match the page cache or the previous image (if provided). The
+ * size must be a multiple of the page size. Pages are written with
+ * WRITE command, back to back. Only one read or write can be active
+ * at a time.
+ */
+guint
+nci_target_t2_write(
+    NciTargetT2* self,
+    guint page,
+    const void* data,
+    const void* prev,
+    guint size,
+    NciTargetT2WriteFunc done,
+    GDestroyNotify destroy,
+    void* user_data)
+{
+    if (self && size && !(size % T2T_PAGE_SIZE) && data &&
+        !self->read && !self->write) {
+        NciTargetT2Write* write = g_slice_new0(NciTargetT2Write);
+        const guint id = nci_target_t2_next_id();
+
+        write->id = id;
+        write->first_page = write->next_page = page;
+        write->end_page = page + size / T2T_PAGE_SIZE;
+        write->data = g_malloc(size);
+        memcpy(write->data, data, size);
+        if (prev) {
+            write->prev = g_malloc(size);
+            memcpy(write->prev, prev, size);
+        }
+        write->batch_pages = g_array_new(FALSE, FALSE, sizeof(guint));
+        write->done = done;
+        write->destroy = destroy;
+        write->user_data = user_data;
+        self->write = write;
+        write->starting = TRUE;
+        nci_target_t2_write_next(self);
+        if (self->write == write) {
+            write->starting = FALSE;
+        }
+
+        /* The write may have already failed */
+        return (self->write && self->write->id == id) ? id : 0;
+    }
+    return 0;
+}
+
+void
+nci_target_t2_cancel_write(
+    NciTargetT2* self,
+    guint id)
+{
+    if (self && id && self->write && self->write->id == id) {
+        NciTargetT2Write* write = self->write;
+
+        if (write->batch_id) {
+            nci_target_t2_write_invalidate_batch(self, 0);
+            self->sector = SECTOR_UNKNOWN;
+            nci_target_cancel_batch(self->target, write->batch_id);
+        }
+        self->write = NULL;
+        nci_target_t2_write_free(write);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2021 Jolla Ltd.
+ * Copyright (C) 2021 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in
+ *      the documentation and/or other materials provided with the
+ *      distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation
+ * are those of the authors and should not be interpreted as representing
+ * any official policies, either expressed or implied.
+ */
+
+#include "nci_plugin_p.h"
+#include "nci_plugin_log.h"
+
+#include <gutil_misc.h>
+
+#define MAX_UID_LEN (10)
+#define EMPTY_SLOT (0)
+
+/*
+ * Open addressing hash set of 64-bit UID hashes. It's compact (8 bytes
+ * per slot, at least half of the slots are empty) and each lookup is
+ * a few memory accesses. The chance of two different UIDs having the
+ * same 64-bit hash is negligible.
+ */
+struct nci_uid_filter {
+    guint64* slots;
+    guint64 mask;
+    guint count;
+};
+
+static
+guint64
+nci_uid_filter_hash(
+    const guint8* uid,
+    guint len)
+{
+    /* FNV-1a, with the length mixed in */
+    guint64 h = G_GUINT64_CONSTANT(14695981039346656037);
+    guint i;
+
+    h = (h ^ len) * G_GUINT64_CONSTANT(1099511628211);
+    for (i = 0; i < len; i++) {
+        h = (h ^ uid[i]) * G_GUINT64_CONSTANT(1099511628211);
+    }
+    return (h == EMPTY_SLOT) ? 1 : h;
+}
+
+static
+gboolean
+nci_uid_filter_insert(
+    NciUidFilter* self,
+    guint64 h)
+{
+    guint64 i = h & self->mask;
+
+    while (self->slots[i] != EMPTY_SLOT) {
+        if (self->slots[i] == h) {
+            return FALSE;
+        }
+        i = (i + 1) & self->mask;
+    }
+    self->slots[i] = h;
+    self->count++;
+    return TRUE;
+}
+
+static
+gboolean
+nci_uid_filter_parse_line(
+    const char* line,
+    gsize len,
+    guint8* uid,
+    guint* uid_len)
+{
+    char hex[2 * MAX_UID_LEN];
+    gsize i, n = 0;
+
+    /* Hex digits, optionally separated by colons or spaces */
+    for (i = 0; i < len && line[i] != '#'; i++) {
+        const char c = line[i];
+
+        if (g_ascii_isxdigit(c)) {
+            if (n == sizeof(hex)) {
+                return FALSE;
+            }
+            hex[n++] = c;
+        } else if (c != ':' && !g_ascii_isspace(c)) {
+            return FALSE;
+        }
+    }
+    if (n && !(n & 1) && gutil_hex2bin(hex, n, uid)) {
+        *uid_len = n / 2;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*==========================================================================*
+ * Internal interface
+ *==========================================================================*/
+
+/*
+ * The file contains one UID per line in hex, e.g. 04:A2:2B:1A:3C:5D:80
+ * Empty lines and comments (starting with #) are ignored.
+ */
+NciUidFilter*
+nci_uid_filter_new_from_file(
+    const char* path)
+{
+    GError* error = NULL;
+    GMappedFile* map;
+
+    if (!path) {
+        return NULL;
+    }
+
+    map = g_mapped_file_new(path, FALSE, &error);
+    if (map) {
+        const char* ptr = g_mapped_file_get_contents(map);
+        const char* end = ptr + g_mapped_file_get_length(map);
+        const char* p;
+        NciUidFilter* self = g_new0(NciUidFilter, 1);
+        guint lines = 0, bad = 0;
+        guint64 size = 16;
+
+        /* Keep the load factor below 1/2 */
+        for (p = ptr; p < end; p++) {
+            if (*p == '\n') {
+                lines++;
+            }
+        }
+        while (size < 2 * ((guint64)lines + 1)) {
+            size <<= 1;
+        }
+        self->mask = size - 1;
+        self->slots = g_new0(guint64, size);
+
+        while (ptr < end) {
+            const char* eol = memchr(ptr, '\n', end - ptr);
+            const gsize len = (eol ? eol : end) - ptr;
+            guint8 uid[MAX_UID_LEN];
+            guint uid_len;
+
+            if (nci_uid_filter_parse_line(ptr, len, uid, &uid_len)) {
+                nci_uid_filter_insert(self, nci_uid_filter_hash(uid,
+                    uid_len));
+            } else {
+                const char* s;
+
+                /* Complain about anything but empty lines and comments */
+                for (s = ptr; s < ptr + len && g_ascii_isspace(*s); s++);
+                if (s < ptr + len && *s != '#') {
+                    bad++;
+                }
+            }
+            ptr += len + 1;
+        }
+        g_mapped_file_unref(map);
+        if (bad) {
+            GWARN("%s: %u invalid line(s)", path, bad);
+        }
+        GDEBUG("Loaded %u UID(s) from %s", self->count, path);
+        return self;
+    } else {
+        GERR("%s", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+}
+
+void
+nci_uid_filter_free(
+    NciUidFilter* self)
+{
+    if (self) {
+        g_free(self->slots);
+        g_free(self);
+    }
+}
+
+gboolean
+nci_uid_filter_contains(
+    const NciUidFilter* self,
+    const guint8* uid,
+    guint len)
+{
+    if (self && len) {
+        const guint64 h = nci_uid_filter_hash(uid, len);
+        guint64 i = h & self->mask;
+
+        while (self->slots[i] != EMPTY_SLOT) {
+            if (self->slots[i] == h) {
+                return TRUE;
+            }
+            i = (i + 1) & self->mask;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */